@@ -10,6 +10,9 @@
 
 #include <wayland-server.h>
 
+#include "desktop/snapshot.h"
+#include "desktop/textures.h"
+
 struct kiwmi_desktop {
     struct wlr_compositor *compositor;
     struct wlr_xdg_shell *xdg_shell;
@@ -22,6 +25,9 @@ struct kiwmi_desktop {
 
     float bg_color[4];
 
+    struct kiwmi_snapshot snapshot;
+    struct kiwmi_textures textures;
+
     struct wl_listener xdg_shell_new_surface;
     struct wl_listener xdg_toplevel_new_decoration;
     struct wl_listener layer_shell_new_surface;
@@ -29,7 +35,13 @@ struct kiwmi_desktop {
 
     struct {
         struct wl_signal new_output;
+        struct wl_signal output_destroy;
+        struct wl_signal output_frame;
+        struct wl_signal usable_area_change;
         struct wl_signal view_map;
+        struct wl_signal view_unmap;
+        struct wl_signal view_change; // position, size, title or app_id
+        struct wl_signal view_focus; // NULL when no view is focused
         struct wl_signal request_active_output;
     } events;
 };
@@ -11,6 +11,7 @@
 #include <stdbool.h>
 
 #include <wayland-server.h>
+#include <wlr/types/wlr_layer_shell_v1.h>
 #include <wlr/types/wlr_surface.h>
 #include <wlr/util/box.h>
 
@@ -29,6 +30,10 @@ struct kiwmi_layer {
     struct wl_listener unmap;
 
     struct wlr_box geom;
+
+    // what 'geom' was computed from, to tell which commits move the surface
+    struct wlr_layer_surface_v1_state arranged;
+    struct wlr_box bounds;
 };
 
 void arrange_layers(struct kiwmi_output *output);
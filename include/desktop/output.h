@@ -8,6 +8,8 @@
 #ifndef KIWMI_DESKTOP_OUTPUT_H
 #define KIWMI_DESKTOP_OUTPUT_H
 
+#include <time.h>
+
 #include <wayland-server.h>
 #include <wlr/util/box.h>
 
@@ -25,6 +27,9 @@ struct kiwmi_output {
 
     int damaged;
 
+    // last frame done sent to the layers below the views while covered
+    struct timespec occluded_frame;
+
     struct {
         struct wl_signal destroy;
         struct wl_signal resize;
@@ -41,6 +46,11 @@ struct kiwmi_render_data {
     void *data;
 };
 
+struct kiwmi_output_frame_event {
+    struct kiwmi_output *output;
+    struct timespec *when; // start of the frame
+};
+
 void new_output_notify(struct wl_listener *listener, void *data);
 
 void output_damage(struct kiwmi_output *output);
@@ -0,0 +1,47 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_DESKTOP_SNAPSHOT_H
+#define KIWMI_DESKTOP_SNAPSHOT_H
+
+#include <stdbool.h>
+
+#include <wayland-server.h>
+
+#include "desktop/snapshot_data.h"
+
+struct kiwmi_desktop;
+
+/**
+ * Publishes the outputs and views in shared memory, each change only
+ * rewrites the entries it affects.
+ */
+struct kiwmi_snapshot {
+    struct kiwmi_desktop *desktop;
+
+    int fd;
+    struct kiwmi_snapshot_data *data; // NULL if it couldn't be created
+
+    // authoritative, the copies in 'data' are only there for the readers
+    uint32_t output_count;
+    uint32_t view_count;
+    bool truncated;
+
+    struct wl_listener layout_change;
+    struct wl_listener usable_area_change;
+    struct wl_listener view_change;
+    struct wl_listener view_focus;
+    struct wl_listener view_map;
+    struct wl_listener view_unmap;
+};
+
+void snapshot_init(
+    struct kiwmi_snapshot *snapshot,
+    struct kiwmi_desktop *desktop);
+void snapshot_fini(struct kiwmi_snapshot *snapshot);
+
+#endif /* KIWMI_DESKTOP_SNAPSHOT_H */
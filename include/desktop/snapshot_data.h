@@ -0,0 +1,63 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_DESKTOP_SNAPSHOT_DATA_H
+#define KIWMI_DESKTOP_SNAPSHOT_DATA_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define KIWMI_SNAPSHOT_MAGIC       0x6977696b // "kiwi" in little endian
+#define KIWMI_SNAPSHOT_VERSION     1
+#define KIWMI_SNAPSHOT_MAX_OUTPUTS 16
+#define KIWMI_SNAPSHOT_MAX_VIEWS   256
+
+#define KIWMI_SNAPSHOT_TRUNCATED 1 // views have been left out, they didn't fit
+
+struct kiwmi_snapshot_box {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
+struct kiwmi_snapshot_output {
+    char name[32];
+    struct kiwmi_snapshot_box geometry;    // layout coordinates
+    struct kiwmi_snapshot_box usable_area; // relative to the output
+};
+
+struct kiwmi_snapshot_view {
+    uint64_t id; // same as view:id()
+    struct kiwmi_snapshot_box geometry; // layout coordinates
+    int32_t pid;
+    uint32_t reserved;
+    char app_id[64];
+    char title[128];
+};
+
+/**
+ * The contents of the memfd handed out by kiwmi_ipc.get_snapshot. It is
+ * updated in place, readers copy it out and retry while 'seq' is odd or has
+ * changed by the time they are done. Strings are NUL terminated, views are
+ * in no particular order.
+ */
+struct kiwmi_snapshot_data {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint32_t seq;
+    uint32_t flags;
+
+    uint64_t focused_view; // id, 0 if none
+
+    uint32_t output_count;
+    uint32_t view_count;
+    struct kiwmi_snapshot_output outputs[KIWMI_SNAPSHOT_MAX_OUTPUTS];
+    struct kiwmi_snapshot_view views[KIWMI_SNAPSHOT_MAX_VIEWS];
+};
+
+#endif /* KIWMI_DESKTOP_SNAPSHOT_DATA_H */
@@ -0,0 +1,46 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_DESKTOP_TEXTURES_H
+#define KIWMI_DESKTOP_TEXTURES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timer.h"
+
+struct kiwmi_desktop;
+struct kiwmi_view;
+
+/**
+ * Parks views that have been hidden for a while, or the ones hidden the
+ * longest when the textures of all views take more than the budget.
+ */
+struct kiwmi_textures {
+    struct kiwmi_desktop *desktop;
+
+    uint64_t hidden_timeout; // ns, 0 to never park a view for it
+    size_t budget;           // bytes, 0 for no limit
+
+    struct kiwmi_timer timer;
+};
+
+void textures_init(
+    struct kiwmi_textures *textures,
+    struct kiwmi_desktop *desktop);
+void textures_fini(struct kiwmi_textures *textures);
+
+void textures_update(struct kiwmi_textures *textures);
+size_t textures_size(struct kiwmi_textures *textures, bool hidden_only);
+
+size_t textures_view_size(struct kiwmi_view *view);
+void textures_view_park(struct kiwmi_view *view);
+void textures_view_unpark(struct kiwmi_view *view);
+void textures_view_commit(struct kiwmi_view *view);
+
+#endif /* KIWMI_DESKTOP_TEXTURES_H */
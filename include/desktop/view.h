@@ -9,7 +9,9 @@
 #define KIWMI_DESKTOP_VIEW_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <unistd.h>
 
@@ -26,6 +28,12 @@ enum kiwmi_view_type {
     KIWMI_VIEW_XDG_SHELL,
 };
 
+struct kiwmi_view_surface {
+    struct wlr_surface *surface;
+    int sx; // relative to the view's main surface
+    int sy;
+};
+
 struct kiwmi_view {
     struct wl_list link;
     struct wl_list children; // struct kiwmi_view_child::link
@@ -41,6 +49,12 @@ struct kiwmi_view {
 
     struct wlr_surface *wlr_surface;
 
+    // the surface tree in rendering order, rebuilt once it has changed
+    struct kiwmi_view_surface *surfaces;
+    size_t surfaces_len;
+    size_t surfaces_capacity;
+    bool surfaces_dirty;
+
     struct wlr_box geom;
 
     struct wl_listener map;
@@ -51,12 +65,22 @@ struct kiwmi_view {
     struct wl_listener new_subsurface;
     struct wl_listener request_move;
     struct wl_listener request_resize;
+    struct wl_listener set_title;
+    struct wl_listener set_app_id;
 
     int x;
     int y;
 
     bool mapped;
     bool hidden;
+    bool suspended; // it can't be seen, see view_set_suspended()
+
+    // last frame done sent while it couldn't be seen
+    struct timespec keepalive_frame;
+
+    uint64_t hidden_since; // see timer_now()
+    size_t textures_size;  // at the last commit
+    bool parked;           // see textures.c
 
     struct {
         struct wl_signal unmap;
@@ -78,6 +102,7 @@ struct kiwmi_view_impl {
     pid_t (*get_pid)(struct kiwmi_view *view);
     void (*set_activated)(struct kiwmi_view *view, bool activated);
     void (*set_size)(struct kiwmi_view *view, uint32_t width, uint32_t height);
+    void (*set_suspended)(struct kiwmi_view *view, bool suspended);
     const char *(
         *get_string_prop)(struct kiwmi_view *view, enum kiwmi_view_prop prop);
     void (*set_tiled)(struct kiwmi_view *view, enum wlr_edges edges);
@@ -112,6 +137,11 @@ struct kiwmi_view_child {
 
     bool mapped;
 
+    // where it was placed when last seen, see view_children_check_moved()
+    int32_t x;
+    int32_t y;
+    struct wl_list *below; // previous sibling link, for subsurfaces
+
     struct wl_listener commit;
     struct wl_listener map;
     struct wl_listener unmap;
@@ -135,13 +165,19 @@ void view_for_each_surface(
     struct kiwmi_view *view,
     wlr_surface_iterator_func_t callback,
     void *user_data);
+void view_surfaces_invalidate(struct kiwmi_view *view);
+void view_children_check_moved(
+    struct kiwmi_view *view,
+    struct wl_list *children);
 pid_t view_get_pid(struct kiwmi_view *view);
 void view_get_size(struct kiwmi_view *view, uint32_t *width, uint32_t *height);
 const char *view_get_app_id(struct kiwmi_view *view);
 const char *view_get_title(struct kiwmi_view *view);
 void view_set_activated(struct kiwmi_view *view, bool activated);
+void view_set_hidden(struct kiwmi_view *view, bool hidden);
 void view_set_size(struct kiwmi_view *view, uint32_t width, uint32_t height);
 void view_set_pos(struct kiwmi_view *view, uint32_t x, uint32_t y);
+void view_set_suspended(struct kiwmi_view *view, bool suspended);
 void view_set_tiled(struct kiwmi_view *view, enum wlr_edges edges);
 struct wlr_surface *view_surface_at(
     struct kiwmi_view *view,
@@ -151,6 +187,7 @@ struct wlr_surface *view_surface_at(
     double *sub_y);
 
 void view_focus(struct kiwmi_view *view);
+bool view_is_occluded(struct kiwmi_view *view);
 struct kiwmi_view *view_at(
     struct kiwmi_desktop *desktop,
     double lx,
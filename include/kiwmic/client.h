@@ -0,0 +1,69 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMIC_CLIENT_H
+#define KIWMIC_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wayland-client.h>
+
+#include "desktop/snapshot_data.h"
+
+#define KIWMIC_CLIENT_VERSION 6    // highest kiwmi_ipc version understood
+#define KIWMIC_MAX_IN_FLIGHT  32   // commands sent without a result yet
+#define KIWMIC_MAX_INLINE     4000 // bytes of a message sent in the request
+
+/**
+ * A connection to kiwmi, which any number of commands can be pipelined on.
+ * Their results are collected in the order they were sent.
+ */
+struct kiwmic_client {
+    struct wl_display *display;
+    struct kiwmi_ipc *ipc;
+
+    struct wl_list pending; // struct kiwmic_command::link
+    size_t in_flight;
+};
+
+struct kiwmic_command {
+    struct wl_list link; // struct kiwmic_client::pending
+    struct kiwmic_client *client;
+    struct kiwmi_command *command;
+    int result_fd; // results are read from here once done, if not -1
+
+    bool done;
+    uint64_t done_at; // ns on CLOCK_MONOTONIC, when the result was dispatched
+    bool success;
+    char *message; // error or encoded results, NULL if out of memory
+};
+
+struct kiwmic_client *kiwmic_client_create(struct wl_display *display);
+void kiwmic_client_destroy(struct kiwmic_client *client);
+uint32_t kiwmic_client_version(struct kiwmic_client *client);
+
+bool kiwmic_client_eval(
+    struct kiwmic_client *client,
+    const char *message,
+    int format,
+    bool side_channel);
+int kiwmic_client_dispatch(struct kiwmic_client *client, int fd);
+struct kiwmic_command *kiwmic_client_poll(struct kiwmic_client *client);
+struct kiwmic_command *kiwmic_client_wait(struct kiwmic_client *client);
+
+void kiwmic_command_destroy(struct kiwmic_command *command);
+
+const struct kiwmi_snapshot_data *kiwmic_client_map_snapshot(
+    struct kiwmic_client *client);
+void kiwmic_snapshot_unmap(const struct kiwmi_snapshot_data *snapshot);
+bool kiwmic_snapshot_read(
+    const struct kiwmi_snapshot_data *snapshot,
+    struct kiwmi_snapshot_data *copy);
+
+#endif /* KIWMIC_CLIENT_H */
@@ -0,0 +1,46 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_LUAK_ALLOCATOR_H
+#define KIWMI_LUAK_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lua.h>
+
+#define KIWMI_ALLOCATOR_GRANULE 16
+#define KIWMI_ALLOCATOR_CLASSES 16 // pooled blocks are up to 256 bytes
+
+struct kiwmi_allocator_chunk;
+
+struct kiwmi_allocator {
+    void *free_lists[KIWMI_ALLOCATOR_CLASSES];
+
+    struct kiwmi_allocator_chunk *chunks;
+    char *bump;       // unused space at the end of the newest chunk
+    size_t bump_left;
+
+    uint64_t live;      // bytes in use by Lua
+    uint64_t peak;      // highest value of live
+    uint64_t pooled;    // bytes held in chunks
+    uint64_t requested; // bytes ever requested, only ever grows
+    uint64_t allocations;
+
+    uint64_t rate_start;       // start of the current rate window
+    uint64_t rate_allocations; // allocations at rate_start
+    double rate;               // allocations per second of the last window
+};
+
+void luaK_allocator_init(struct kiwmi_allocator *allocator);
+void luaK_allocator_fini(struct kiwmi_allocator *allocator);
+void *luaK_allocator_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+void luaK_allocator_push_stats(
+    struct kiwmi_allocator *allocator,
+    lua_State *L);
+
+#endif /* KIWMI_LUAK_ALLOCATOR_H */
@@ -0,0 +1,44 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_LUAK_GC_H
+#define KIWMI_LUAK_GC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <lua.h>
+#include <wayland-server.h>
+
+#include "timer.h"
+
+struct kiwmi_server;
+
+struct kiwmi_lua_gc {
+    lua_State *L;
+    struct kiwmi_server *server;
+    bool enabled; // false leaves collecting to Lua
+
+    bool cycle_running;
+    int estimate; // KiB in use after the last finished cycle
+
+    uint64_t deadline;   // the earliest upcoming frame
+    uint64_t last_frame; // when the last frame was committed
+    struct wl_event_source *idle;
+    struct kiwmi_timer fallback;
+
+    struct wl_listener output_frame;
+};
+
+void luaK_gc_init(
+    struct kiwmi_lua_gc *gc,
+    lua_State *L,
+    struct kiwmi_server *server);
+void luaK_gc_fini(struct kiwmi_lua_gc *gc);
+void luaK_gc_set_enabled(struct kiwmi_lua_gc *gc, bool enabled);
+
+#endif /* KIWMI_LUAK_GC_H */
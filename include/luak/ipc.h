@@ -9,10 +9,141 @@
 #define KIWMI_LUAK_IPC_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lua.h>
+#include <wayland-server.h>
 
-#include "luak/luak.h"
 #include "server.h"
+#include "timer.h"
+
+/**
+ * Commands are queued per client and run round-robin, at most 'rate' per
+ * second after an initial 'burst'. Each dispatch runs them for no longer
+ * than 'budget', so input and rendering carry on in between.
+ */
+struct kiwmi_ipc_limits {
+    double rate;     // commands per second, 0 for no limit
+    double burst;    // commands
+    size_t queue;    // commands waiting per client before new ones fail
+    uint64_t budget; // ns, 0 to run everything at once
+};
+
+struct kiwmi_ipc_stats {
+    uint64_t queued;
+    uint64_t executed;
+    uint64_t rejected;
+};
+
+struct kiwmi_ipc {
+    struct kiwmi_server *server;
+    struct wl_global *global;
+    struct wl_list clients;       // struct kiwmi_ipc_client::link
+    struct wl_list subscriptions; // struct kiwmi_ipc_subscription::link
+    struct wl_list results;       // struct kiwmi_ipc_result::link
+
+    struct kiwmi_ipc_limits limits;
+    struct kiwmi_ipc_stats stats;
+
+    struct wl_event_source *idle; // NULL unless a run is scheduled
+    struct kiwmi_timer timer;     // continues a run that was cut short
+
+    struct wl_listener new_output;
+    struct wl_listener output_destroy;
+    struct wl_listener view_focus;
+    struct wl_listener view_map;
+    struct wl_listener view_unmap;
+};
+
+struct kiwmi_ipc_subscription {
+    struct wl_list link;
+    struct wl_resource *resource;
+    uint32_t event_classes; // enum kiwmi_ipc_event_class
+};
+
+/**
+ * Created for each client with commands queued, goes away with it.
+ */
+struct kiwmi_ipc_client {
+    struct wl_list link; // struct kiwmi_ipc::clients
+    struct kiwmi_ipc *ipc;
+    struct wl_listener destroy;
+
+    struct wl_list jobs; // struct kiwmi_ipc_job::link
+    size_t queued;
+
+    double tokens;
+    uint64_t last_refill; // ns
+};
+
+#define KIWMI_IPC_BODY_MAX (16 * 1024 * 1024) // bytes
+
+/**
+ * A command waiting for its turn. It belongs to the kiwmi_command resource,
+ * which is destroyed once it has run. Bodies passed with eval_fd are read
+ * in the meantime, later commands of the client wait until they are.
+ */
+struct kiwmi_ipc_job {
+    struct wl_list link;             // struct kiwmi_ipc_client::jobs
+    struct kiwmi_ipc_client *client; // NULL once it has run or is gone
+    struct kiwmi_ipc *ipc;
+    struct wl_resource *resource;
+    struct wl_event_source *event_source; // NULL unless reading the body
+
+    int fd;        // body being read, -1 if there is none
+    int result_fd; // -1 to send the results with the done event
+    uint32_t format;
+    bool ready;
+    int error; // errno from reading the body
+
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+/**
+ * Encoded results being written to the fd passed with eval_fd, which
+ * carries on after the command is done.
+ */
+struct kiwmi_ipc_result {
+    struct wl_list link; // struct kiwmi_ipc::results
+    struct wl_event_source *event_source;
+
+    int fd;
+
+    char *data;
+    size_t len;
+    size_t written;
+};
+
+#define KIWMI_IPC_CACHE_SIZE 64
+
+struct kiwmi_ipc_chunk {
+    uint64_t hash;
+    char *message; // NULL for unused entries
+    int ref;       // the compiled chunk
+    uint64_t last_used;
+};
+
+struct kiwmi_ipc_cache {
+    struct kiwmi_ipc_chunk chunks[KIWMI_IPC_CACHE_SIZE];
+    uint64_t clock;
+
+    uint64_t hits;
+    uint64_t misses;
+};
 
-bool luaK_ipc_init(struct kiwmi_server *server, struct kiwmi_lua *lua);
+bool luaK_ipc_init(struct kiwmi_server *server);
+void luaK_ipc_fini(struct kiwmi_server *server);
+int luaK_ipc_emit(struct kiwmi_ipc *ipc, lua_State *L, const char *name);
+void luaK_ipc_push_stats(struct kiwmi_ipc *ipc, lua_State *L);
+void luaK_ipc_cache_init(struct kiwmi_ipc_cache *cache);
+void luaK_ipc_cache_fini(struct kiwmi_ipc_cache *cache);
+int luaK_ipc_cache_load(
+    struct kiwmi_ipc_cache *cache,
+    lua_State *L,
+    const char *message);
+void luaK_ipc_cache_push_stats(struct kiwmi_ipc_cache *cache, lua_State *L);
 
 #endif /* KIWMI_LUAK_IPC_H */
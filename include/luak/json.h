@@ -0,0 +1,16 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_LUAK_JSON_H
+#define KIWMI_LUAK_JSON_H
+
+#include <lua.h>
+
+int luaK_json_encode(lua_State *L, int n);
+int luaK_json_encode_value(lua_State *L);
+
+#endif /* KIWMI_LUAK_JSON_H */
@@ -16,12 +16,18 @@ struct kiwmi_lua_callback {
     struct wl_list link;
     struct kiwmi_server *server;
     int callback_ref;
-    union {
-        struct wl_event_source *event_source;
-        struct wl_listener listener;
-    };
+    struct wl_event_source *event_source; // NULL for signal listeners
+    struct wl_listener listener;          // link is empty for event sources
+    struct kiwmi_timer *timer;            // NULL unless scheduled
+
+    struct {
+        struct wl_signal destroy;
+    } events;
 };
 
 int luaK_kiwmi_lua_callback_new(lua_State *L);
+int luaK_kiwmi_lua_callback_handle(lua_State *L);
+int luaK_kiwmi_lua_callback_register(lua_State *L);
+void luaK_kiwmi_lua_callback_destroy(struct kiwmi_lua_callback *lc);
 
 #endif /* KIWMI_LUAK_KIWMI_LUA_CALLBACK_H */
@@ -10,7 +10,10 @@
 
 #include <lua.h>
 
+struct kiwmi_lua;
+
 int luaK_kiwmi_server_new(lua_State *L);
 int luaK_kiwmi_server_register(lua_State *L);
+void luaK_kiwmi_server_replay(struct kiwmi_lua *lua);
 
 #endif /* KIWMI_LUAK_KIWMI_SERVER_H */
@@ -16,6 +16,26 @@
 
 #define luaC_newlib(L, l) (luaC_newlibtable(L, l), luaC_setfuncs(L, l, 0))
 
+#if LUA_VERSION_NUM >= 502
+#    define luaC_rawlen(L, i) lua_rawlen(L, i)
+#else
+#    define luaC_rawlen(L, i) lua_objlen(L, i)
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#    define luaC_dump(L, writer, data) lua_dump(L, writer, data, 0)
+#else
+#    define luaC_dump(L, writer, data) lua_dump(L, writer, data)
+#endif
+
+#if LUA_VERSION_NUM >= 502
+#    define LUAC_SEARCHERS "searchers"
+#else
+#    define LUAC_SEARCHERS "loaders"
+#endif
+
+int luaC_resume(lua_State *L, lua_State *from, int nargs);
 void luaC_setfuncs(lua_State *L, const luaL_Reg *l, int nup);
+void luaC_traceback(lua_State *L, const char *msg);
 
 #endif /* KIWMI_LUAK_LUA_COMPAT_H */
@@ -13,13 +13,42 @@
 #include <lua.h>
 #include <wayland-server.h>
 
+#include "luak/allocator.h"
+#include "luak/gc.h"
+#include "luak/ipc.h"
+#include "luak/profiler.h"
 #include "server.h"
 
+struct kiwmi_watchdog {
+    int instructions; // budget per call into Lua, 0 to disable
+    int strikes;      // aborts until a callback is disabled, 0 for never
+    int offenders;    // function -> number of aborts
+    int depth;        // nested calls share the budget of the outermost one
+    int used;
+    bool tripped;
+};
+
 struct kiwmi_lua {
     lua_State *L;
+    struct kiwmi_server *server;
     int objects;
-    struct wl_list scheduled_callbacks;
-    struct wl_global *global;
+    struct wl_list scheduled_callbacks; // struct kiwmi_lua_callback::link
+
+    int deferred;      // array of functions for the next idle dispatch
+    int deferred_keys; // coalescing key -> index into deferred
+    struct wl_event_source *deferred_idle;
+    struct kiwmi_timer deferred_timer; // for those deferred while running
+    bool deferring;
+
+    struct wl_event_source *reload_idle;
+
+    struct kiwmi_allocator allocator;
+    struct kiwmi_lua_gc gc;
+    struct kiwmi_ipc_cache ipc_cache;
+    struct kiwmi_profiler profiler;
+    struct kiwmi_watchdog watchdog;
+
+    struct wl_listener event_loop_destroy;
 };
 
 struct kiwmi_object {
@@ -45,8 +74,17 @@ struct kiwmi_object *luaK_get_kiwmi_object(
     struct wl_signal *destroy);
 int luaK_callback_register_dispatch(lua_State *L);
 int luaK_usertype_ref_equal(lua_State *L);
+int luaK_pcall(
+    struct kiwmi_lua *lua,
+    int nargs,
+    int nresults,
+    const char *event);
+int luaK_resume(struct kiwmi_lua *lua, lua_State *co, int nargs);
+void luaK_watchdog_reset(struct kiwmi_lua *lua);
+void luaK_run_deferred(struct kiwmi_lua *lua);
 struct kiwmi_lua *luaK_create(struct kiwmi_server *server);
 bool luaK_dofile(struct kiwmi_lua *lua, const char *config_path);
+bool luaK_reload(struct kiwmi_lua *lua);
 void luaK_destroy(struct kiwmi_lua *lua);
 
 #endif /* KIWMI_LUAK_LUAK_H */
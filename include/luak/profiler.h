@@ -0,0 +1,51 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_LUAK_PROFILER_H
+#define KIWMI_LUAK_PROFILER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lua.h>
+
+// "short_src:linedefined" of the callback
+#define KIWMI_PROFILER_SOURCE_SIZE (LUA_IDSIZE + 16)
+
+struct kiwmi_profiler_entry {
+    const char *event; // static string
+    char source[KIWMI_PROFILER_SOURCE_SIZE];
+
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t allocated; // bytes requested from the allocator
+};
+
+struct kiwmi_profiler {
+    bool enabled;
+
+    struct kiwmi_profiler_entry *entries;
+    size_t len;
+    size_t capacity;
+};
+
+void luaK_profiler_init(struct kiwmi_profiler *profiler);
+void luaK_profiler_fini(struct kiwmi_profiler *profiler);
+void luaK_profiler_reset(struct kiwmi_profiler *profiler);
+void luaK_profiler_record(
+    struct kiwmi_profiler *profiler,
+    const char *event,
+    const char *source,
+    uint64_t elapsed_ns,
+    uint64_t allocated);
+void luaK_profiler_push_report(
+    struct kiwmi_profiler *profiler,
+    lua_State *L);
+
+#endif /* KIWMI_LUAK_PROFILER_H */
@@ -0,0 +1,68 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_PROCESS_H
+#define KIWMI_PROCESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include <wayland-server.h>
+
+struct kiwmi_server;
+
+struct kiwmi_spawn_options {
+    char *const *argv; // NULL terminated, argv[0] is looked up in PATH
+    char *const *env;  // NULL terminated "NAME=value" or "NAME" (to unset)
+    const char *cwd;   // NULL to inherit
+    int stdout_fd;     // -1 to inherit
+    int stderr_fd;     // -1 to inherit
+};
+
+struct kiwmi_process_pipe {
+    struct kiwmi_process *process;
+    struct wl_signal *signal;
+    int fd; // -1 once EOF has been reached
+    struct wl_event_source *event_source;
+};
+
+struct kiwmi_process {
+    struct wl_list link; // struct kiwmi_server::processes
+    struct kiwmi_server *server;
+
+    pid_t pid;
+    bool exited;
+    int status; // as returned by waitpid()
+
+    struct kiwmi_process_pipe out;
+    struct kiwmi_process_pipe err;
+
+    struct {
+        struct wl_signal stdout_data;
+        struct wl_signal stderr_data;
+        struct wl_signal exit;
+        struct wl_signal destroy;
+    } events;
+};
+
+struct kiwmi_process_data_event {
+    struct kiwmi_process *process;
+    const char *data;
+    size_t len;
+};
+
+pid_t process_spawn(const struct kiwmi_spawn_options *options);
+struct kiwmi_process *process_spawn_async(
+    struct kiwmi_server *server,
+    const struct kiwmi_spawn_options *options);
+
+bool process_reaper_init(struct kiwmi_server *server);
+void process_reaper_fini(struct kiwmi_server *server);
+
+#endif /* KIWMI_PROCESS_H */
@@ -12,6 +12,7 @@
 
 #include "desktop/desktop.h"
 #include "input/input.h"
+#include "timer.h"
 
 struct kiwmi_server {
     struct wl_display *wl_display;
@@ -23,9 +24,15 @@ struct kiwmi_server {
     const char *socket;
     char *config_path;
     struct kiwmi_lua *lua;
+    struct kiwmi_ipc *ipc; // outlives reloads of the Lua state
     struct kiwmi_desktop desktop;
     struct kiwmi_input input;
 
+    struct wl_list processes; // struct kiwmi_process::link
+    struct wl_event_source *sigchld_source;
+
+    struct kiwmi_timer_queue timers;
+
     struct {
         struct wl_signal destroy;
     } events;
@@ -0,0 +1,62 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_TIMER_H
+#define KIWMI_TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wayland-server.h>
+
+struct kiwmi_timer;
+
+typedef void (*kiwmi_timer_func_t)(struct kiwmi_timer *timer, void *data);
+
+/**
+ * All timers share a single timerfd, the pending ones are kept in a binary
+ * min-heap ordered by deadline.
+ */
+struct kiwmi_timer_queue {
+    int fd;
+    struct wl_event_source *event_source;
+
+    struct kiwmi_timer **heap;
+    size_t len;
+    size_t capacity;
+
+    uint64_t armed; // deadline the timerfd is set to, 0 if disarmed
+};
+
+struct kiwmi_timer {
+    struct kiwmi_timer_queue *queue;
+    kiwmi_timer_func_t func;
+    void *data;
+
+    uint64_t deadline; // CLOCK_MONOTONIC in ns
+    uint64_t interval; // ns, 0 for one-shot timers
+    size_t index;      // position in the heap, SIZE_MAX if not pending
+};
+
+uint64_t timer_now(void);
+
+bool timer_queue_init(
+    struct kiwmi_timer_queue *queue,
+    struct wl_event_loop *loop);
+void timer_queue_fini(struct kiwmi_timer_queue *queue);
+
+void timer_init(
+    struct kiwmi_timer *timer,
+    struct kiwmi_timer_queue *queue,
+    kiwmi_timer_func_t func,
+    void *data);
+bool timer_arm(struct kiwmi_timer *timer, uint64_t delay, uint64_t interval);
+void timer_disarm(struct kiwmi_timer *timer);
+bool timer_pending(struct kiwmi_timer *timer);
+
+#endif /* KIWMI_TIMER_H */
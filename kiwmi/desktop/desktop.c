@@ -76,15 +76,27 @@ desktop_init(struct kiwmi_desktop *desktop)
     wl_signal_add(&server->backend->events.new_output, &desktop->new_output);
 
     wl_signal_init(&desktop->events.new_output);
+    wl_signal_init(&desktop->events.output_destroy);
+    wl_signal_init(&desktop->events.output_frame);
+    wl_signal_init(&desktop->events.usable_area_change);
     wl_signal_init(&desktop->events.view_map);
+    wl_signal_init(&desktop->events.view_unmap);
+    wl_signal_init(&desktop->events.view_change);
+    wl_signal_init(&desktop->events.view_focus);
     wl_signal_init(&desktop->events.request_active_output);
 
+    snapshot_init(&desktop->snapshot, desktop);
+    textures_init(&desktop->textures, desktop);
+
     return true;
 }
 
 void
 desktop_fini(struct kiwmi_desktop *desktop)
 {
+    textures_fini(&desktop->textures);
+    snapshot_fini(&desktop->snapshot);
+
     wlr_output_layout_destroy(desktop->output_layout);
     desktop->output_layout = NULL;
 }
@@ -8,6 +8,7 @@
 #include "desktop/layer_shell.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <pixman.h>
 #include <wayland-server.h>
@@ -34,34 +35,6 @@ kiwmi_layer_destroy_notify(struct wl_listener *listener, void *UNUSED(data))
     free(layer);
 }
 
-static void
-kiwmi_layer_commit_notify(struct wl_listener *listener, void *UNUSED(data))
-{
-    struct kiwmi_layer *layer   = wl_container_of(listener, layer, commit);
-    struct kiwmi_output *output = layer->output;
-
-    struct wlr_box old_geom = layer->geom;
-
-    if (layer->layer_surface->current.committed != 0) {
-        arrange_layers(output);
-    }
-
-    bool layer_changed = layer->layer != layer->layer_surface->current.layer;
-    bool geom_changed  = memcmp(&old_geom, &layer->geom, sizeof(old_geom)) != 0;
-    bool buffer_changed = pixman_region32_not_empty(
-        &layer->layer_surface->surface->buffer_damage);
-
-    if (layer_changed) {
-        wl_list_remove(&layer->link);
-        layer->layer = layer->layer_surface->current.layer;
-        wl_list_insert(&output->layers[layer->layer], &layer->link);
-    }
-
-    if (buffer_changed || layer_changed || geom_changed) {
-        output_damage(layer->output);
-    }
-}
-
 static void
 kiwmi_layer_map_notify(struct wl_listener *listener, void *UNUSED(data))
 {
@@ -146,6 +119,93 @@ apply_exclusive(
     }
 }
 
+/**
+ * Places the surface within 'bounds' and sends it its size. Returns false if
+ * it had to be destroyed instead.
+ */
+static bool
+arrange_surface(struct kiwmi_layer *layer, const struct wlr_box *area)
+{
+    struct wlr_layer_surface_v1 *layer_surface = layer->layer_surface;
+    struct wlr_layer_surface_v1_state *state   = &layer_surface->current;
+    struct wlr_box bounds                      = *area;
+
+    struct wlr_box arranged_area = {
+        .width  = state->desired_width,
+        .height = state->desired_height,
+    };
+
+    // horizontal
+    const uint32_t both_horiz = ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
+        | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
+
+    if ((state->anchor & both_horiz) && arranged_area.width == 0) {
+        arranged_area.x     = bounds.x;
+        arranged_area.width = bounds.width;
+    } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT) {
+        arranged_area.x = bounds.x;
+    } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT) {
+        arranged_area.x = bounds.x + (bounds.width - arranged_area.width);
+    } else {
+        arranged_area.x =
+            bounds.x + ((bounds.width / 2) - (arranged_area.width / 2));
+    }
+
+    // vertical
+    const uint32_t both_vert = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP
+        | ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM;
+    if ((state->anchor & both_vert) && arranged_area.height == 0) {
+        arranged_area.y      = bounds.y;
+        arranged_area.height = bounds.height;
+    } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP) {
+        arranged_area.y = bounds.y;
+    } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM) {
+        arranged_area.y = bounds.y + (bounds.height - arranged_area.height);
+    } else {
+        arranged_area.y =
+            bounds.y + ((bounds.height / 2) - (arranged_area.height / 2));
+    }
+
+    // left and right margin
+    if ((state->anchor & both_horiz) == both_horiz) {
+        arranged_area.x += state->margin.left;
+        arranged_area.width -= state->margin.left + state->margin.right;
+    } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT) {
+        arranged_area.x += state->margin.left;
+    } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT) {
+        arranged_area.x -= state->margin.right;
+    }
+
+    // top and bottom margin
+    if ((state->anchor & both_vert) == both_vert) {
+        arranged_area.y += state->margin.top;
+        arranged_area.height -= state->margin.top + state->margin.bottom;
+    } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP) {
+        arranged_area.y += state->margin.top;
+    } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM) {
+        arranged_area.y -= state->margin.bottom;
+    }
+
+    if (arranged_area.width < 0 || arranged_area.height < 0) {
+        wlr_log(
+            WLR_ERROR,
+            "Bad width/height: %d, %d",
+            arranged_area.width,
+            arranged_area.height);
+        wlr_layer_surface_v1_destroy(layer_surface);
+        return false;
+    }
+
+    layer->geom     = arranged_area;
+    layer->bounds   = bounds;
+    layer->arranged = *state;
+
+    wlr_layer_surface_v1_configure(
+        layer_surface, arranged_area.width, arranged_area.height);
+
+    return true;
+}
+
 static void
 arrange_layer(
     struct kiwmi_output *output,
@@ -160,89 +220,19 @@ arrange_layer(
 
     struct kiwmi_layer *layer;
     wl_list_for_each_reverse (layer, layers, link) {
-        struct wlr_layer_surface_v1 *layer_surface = layer->layer_surface;
-        struct wlr_layer_surface_v1_state *state   = &layer_surface->current;
+        struct wlr_layer_surface_v1_state *state =
+            &layer->layer_surface->current;
 
         if (exclusive != (state->exclusive_zone >= 0)) {
             continue;
         }
 
-        struct wlr_box bounds;
-
-        if (state->exclusive_zone == -1) {
-            bounds = full_area;
-        } else {
-            bounds = *usable_area;
-        }
-
-        struct wlr_box arranged_area = {
-            .width  = state->desired_width,
-            .height = state->desired_height,
-        };
-
-        // horizontal
-        const uint32_t both_horiz = ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
-            | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
-
-        if ((state->anchor & both_horiz) && arranged_area.width == 0) {
-            arranged_area.x     = bounds.x;
-            arranged_area.width = bounds.width;
-        } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT) {
-            arranged_area.x = bounds.x;
-        } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT) {
-            arranged_area.x = bounds.x + (bounds.width - arranged_area.width);
-        } else {
-            arranged_area.x =
-                bounds.x + ((bounds.width / 2) - (arranged_area.width / 2));
-        }
-
-        // vertical
-        const uint32_t both_vert = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP
-            | ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM;
-        if ((state->anchor & both_vert) && arranged_area.height == 0) {
-            arranged_area.y      = bounds.y;
-            arranged_area.height = bounds.height;
-        } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP) {
-            arranged_area.y = bounds.y;
-        } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM) {
-            arranged_area.y = bounds.y + (bounds.height - arranged_area.height);
-        } else {
-            arranged_area.y =
-                bounds.y + ((bounds.height / 2) - (arranged_area.height / 2));
-        }
-
-        // left and right margin
-        if ((state->anchor & both_horiz) == both_horiz) {
-            arranged_area.x += state->margin.left;
-            arranged_area.width -= state->margin.left + state->margin.right;
-        } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT) {
-            arranged_area.x += state->margin.left;
-        } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT) {
-            arranged_area.x -= state->margin.right;
-        }
-
-        // top and bottom margin
-        if ((state->anchor & both_vert) == both_vert) {
-            arranged_area.y += state->margin.top;
-            arranged_area.height -= state->margin.top + state->margin.bottom;
-        } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP) {
-            arranged_area.y += state->margin.top;
-        } else if (state->anchor & ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM) {
-            arranged_area.y -= state->margin.bottom;
-        }
-
-        if (arranged_area.width < 0 || arranged_area.height < 0) {
-            wlr_log(
-                WLR_ERROR,
-                "Bad width/height: %d, %d",
-                arranged_area.width,
-                arranged_area.height);
-            wlr_layer_surface_v1_destroy(layer_surface);
+        const struct wlr_box *bounds =
+            state->exclusive_zone == -1 ? &full_area : usable_area;
+        if (!arrange_surface(layer, bounds)) {
             continue;
         }
 
-        layer->geom = arranged_area;
-
         apply_exclusive(
             usable_area,
             state->anchor,
@@ -251,10 +241,42 @@ arrange_layer(
             state->margin.bottom,
             state->margin.left,
             state->margin.right);
+    }
+}
+
+/**
+ * Gives the keyboard to the topmost surface above the views that asks for
+ * it.
+ */
+static void
+arrange_focus(struct kiwmi_output *output)
+{
+    uint32_t layers_above_shell[] = {
+        ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY,
+        ZWLR_LAYER_SHELL_V1_LAYER_TOP,
+    };
+    size_t nlayers = sizeof(layers_above_shell) / sizeof(layers_above_shell[0]);
+    struct kiwmi_layer *layer;
+    struct kiwmi_layer *topmost = NULL;
+    for (size_t i = 0; i < nlayers; ++i) {
+        wl_list_for_each_reverse (
+            layer, &output->layers[layers_above_shell[i]], link) {
+            if (layer->layer_surface->current.keyboard_interactive) {
+                topmost = layer;
+                break;
+            }
+        }
 
-        wlr_layer_surface_v1_configure(
-            layer_surface, arranged_area.width, arranged_area.height);
+        if (topmost) {
+            break;
+        }
     }
+
+    struct kiwmi_desktop *desktop = output->desktop;
+    struct kiwmi_server *server   = wl_container_of(desktop, server, desktop);
+    struct kiwmi_seat *seat       = server->input.seat;
+
+    seat_focus_layer(seat, topmost);
 }
 
 void
@@ -309,38 +331,96 @@ arrange_layers(struct kiwmi_output *output)
         &usable_area,
         false);
 
-    uint32_t layers_above_shell[] = {
-        ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY,
-        ZWLR_LAYER_SHELL_V1_LAYER_TOP,
-    };
-    size_t nlayers = sizeof(layers_above_shell) / sizeof(layers_above_shell[0]);
-    struct kiwmi_layer *layer;
-    struct kiwmi_layer *topmost = NULL;
-    for (size_t i = 0; i < nlayers; ++i) {
-        wl_list_for_each_reverse (
-            layer, &output->layers[layers_above_shell[i]], link) {
-            if (layer->layer_surface->current.keyboard_interactive) {
-                topmost = layer;
-                break;
-            }
-        }
-
-        if (topmost) {
-            break;
-        }
-    }
-
     if (memcmp(&usable_area, &output->usable_area, sizeof(output->usable_area))
         != 0) {
         memcpy(&output->usable_area, &usable_area, sizeof(output->usable_area));
         wl_signal_emit(&output->events.usable_area_change, output);
+        wl_signal_emit(&output->desktop->events.usable_area_change, output);
     }
 
-    struct kiwmi_desktop *desktop = output->desktop;
-    struct kiwmi_server *server   = wl_container_of(desktop, server, desktop);
-    struct kiwmi_seat *seat       = server->input.seat;
+    arrange_focus(output);
+}
 
-    seat_focus_layer(seat, topmost);
+/**
+ * Only the fields that move the surface count, bars tend to send the same
+ * size and margins along with their new contents.
+ */
+static bool
+layer_geometry_changed(struct kiwmi_layer *layer)
+{
+    const uint32_t fields = WLR_LAYER_SURFACE_V1_STATE_DESIRED_SIZE
+        | WLR_LAYER_SURFACE_V1_STATE_ANCHOR
+        | WLR_LAYER_SURFACE_V1_STATE_EXCLUSIVE_ZONE
+        | WLR_LAYER_SURFACE_V1_STATE_MARGIN;
+
+    struct wlr_layer_surface_v1_state *state = &layer->layer_surface->current;
+    struct wlr_layer_surface_v1_state *old   = &layer->arranged;
+
+    if (!(state->committed & fields)) {
+        return false;
+    }
+
+    return state->desired_width != old->desired_width
+        || state->desired_height != old->desired_height
+        || state->anchor != old->anchor
+        || state->exclusive_zone != old->exclusive_zone
+        || memcmp(&state->margin, &old->margin, sizeof(state->margin)) != 0;
+}
+
+/**
+ * A surface that doesn't reserve space before or after the change doesn't
+ * affect the others, it is placed within the same bounds as last time.
+ */
+static void
+arrange_layer_surface(struct kiwmi_layer *layer)
+{
+    struct wlr_layer_surface_v1_state *state = &layer->layer_surface->current;
+
+    if (state->exclusive_zone > 0
+        || state->exclusive_zone != layer->arranged.exclusive_zone) {
+        arrange_layers(layer->output);
+        return;
+    }
+
+    arrange_surface(layer, &layer->bounds);
+}
+
+static void
+kiwmi_layer_commit_notify(struct wl_listener *listener, void *UNUSED(data))
+{
+    struct kiwmi_layer *layer   = wl_container_of(listener, layer, commit);
+    struct kiwmi_output *output = layer->output;
+
+    struct wlr_layer_surface_v1_state *state = &layer->layer_surface->current;
+
+    struct wlr_box old_geom = layer->geom;
+
+    bool layer_changed = layer->layer != state->layer;
+    if (layer_changed) {
+        wl_list_remove(&layer->link);
+        layer->layer = state->layer;
+        wl_list_insert(&output->layers[layer->layer], &layer->link);
+
+        arrange_layers(output);
+    } else {
+        if (layer_geometry_changed(layer)) {
+            arrange_layer_surface(layer);
+        }
+
+        uint32_t keyboard = WLR_LAYER_SURFACE_V1_STATE_KEYBOARD_INTERACTIVITY;
+        if (state->committed & keyboard) {
+            arrange_focus(output);
+        }
+    }
+
+    bool geom_changed = memcmp(&old_geom, &layer->geom, sizeof(old_geom)) != 0;
+    bool buffer_changed = pixman_region32_not_empty(
+        &layer->layer_surface->surface->buffer_damage);
+
+    // there is no finer damage tracking, the whole output is redrawn
+    if (buffer_changed || layer_changed || geom_changed) {
+        output_damage(output);
+    }
 }
 
 struct kiwmi_layer *
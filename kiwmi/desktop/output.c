@@ -29,6 +29,8 @@
 #include "input/input.h"
 #include "server.h"
 
+#define OCCLUDED_FRAME_INTERVAL 1000 // ms
+
 static void
 render_layer_surface(struct wlr_surface *surface, int x, int y, void *data)
 {
@@ -95,6 +97,79 @@ send_frame_done_to_layer(struct wl_list *layer, struct timespec *now)
     }
 }
 
+/**
+ * Whether a view covers the whole output with opaque content, which hides
+ * the background and bottom layers.
+ */
+static bool
+output_occluded(struct kiwmi_output *output, double output_lx, double output_ly)
+{
+    int width;
+    int height;
+    wlr_output_effective_resolution(output->wlr_output, &width, &height);
+
+    struct kiwmi_view *view;
+    wl_list_for_each (view, &output->desktop->views, link) {
+        if (view->hidden || !view->mapped || !view->wlr_surface) {
+            continue;
+        }
+
+        // the output in surface coordinates, output_lx/ly are those of the
+        // layout origin relative to the output, so its position negated
+        int sx = -output_lx - (view->x - view->geom.x);
+        int sy = -output_ly - (view->y - view->geom.y);
+
+        pixman_box32_t box = {
+            .x1 = sx,
+            .y1 = sy,
+            .x2 = sx + width,
+            .y2 = sy + height,
+        };
+
+        if (pixman_region32_contains_rectangle(
+                &view->wlr_surface->opaque_region, &box)
+            == PIXMAN_REGION_IN) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Surfaces that can't be seen only get a frame done every now and then, so
+ * they don't keep drawing, but don't think they are gone either.
+ */
+static bool
+keepalive_frame_due(struct timespec *last, struct timespec *now)
+{
+    int64_t elapsed = (int64_t)(now->tv_sec - last->tv_sec) * 1000
+                    + (now->tv_nsec - last->tv_nsec) / 1000000;
+    if (elapsed < OCCLUDED_FRAME_INTERVAL) {
+        return false;
+    }
+
+    *last = *now;
+
+    return true;
+}
+
+/**
+ * Keeps animated wallpapers from drawing behind fullscreen views.
+ */
+static void
+send_frame_done_to_occluded(struct kiwmi_output *output, struct timespec *now)
+{
+    if (!keepalive_frame_due(&output->occluded_frame, now)) {
+        return;
+    }
+
+    send_frame_done_to_layer(
+        &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND], now);
+    send_frame_done_to_layer(
+        &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM], now);
+}
+
 static void
 render_surface(struct wlr_surface *surface, int sx, int sy, void *data)
 {
@@ -124,8 +199,6 @@ render_surface(struct wlr_surface *surface, int sx, int sy, void *data)
         matrix, &box, transform, 0, wlr_output->transform_matrix);
 
     wlr_render_texture_with_matrix(rdata->renderer, texture, matrix, 1);
-
-    wlr_surface_send_frame_done(surface, rdata->when);
 }
 
 static void
@@ -139,6 +212,38 @@ send_frame_done_to_surface(
     wlr_surface_send_frame_done(surface, now);
 }
 
+/**
+ * Views that are hidden or covered by another one are suspended, and get
+ * frame done events as rarely as the layers behind fullscreen views. Parked
+ * ones get none (see textures.c).
+ */
+static void
+send_frame_done_to_view(struct kiwmi_view *view, struct timespec *now)
+{
+    bool visible = view->mapped && !view->hidden && !view_is_occluded(view);
+
+    if (view->mapped) {
+        view_set_suspended(view, !visible);
+    }
+
+    if (!visible) {
+        if (view->parked || !keepalive_frame_due(&view->keepalive_frame, now)) {
+            return;
+        }
+    }
+
+    view_for_each_surface(view, send_frame_done_to_surface, now);
+}
+
+static void
+send_frame_done_to_views(struct kiwmi_desktop *desktop, struct timespec *now)
+{
+    struct kiwmi_view *view;
+    wl_list_for_each (view, &desktop->views, link) {
+        send_frame_done_to_view(view, now);
+    }
+}
+
 static bool
 render_cursors(struct wlr_output *wlr_output)
 {
@@ -151,6 +256,21 @@ render_cursors(struct wlr_output *wlr_output)
     return damaged;
 }
 
+/**
+ * Lets others use the time left until the next frame, once this one has been
+ * committed.
+ */
+static void
+output_frame_done(struct kiwmi_output *output, struct timespec *when)
+{
+    struct kiwmi_output_frame_event event = {
+        .output = output,
+        .when   = when,
+    };
+
+    wl_signal_emit(&output->desktop->events.output_frame, &event);
+}
+
 static void
 output_frame_notify(struct wl_listener *listener, void *data)
 {
@@ -167,30 +287,40 @@ output_frame_notify(struct wl_listener *listener, void *data)
         return;
     }
 
+    struct wlr_output_layout *output_layout = desktop->output_layout;
+
+    double output_lx = 0;
+    double output_ly = 0;
+    wlr_output_layout_output_coords(
+        output_layout, wlr_output, &output_lx, &output_ly);
+
+    bool occluded = output_occluded(output, output_lx, output_ly);
+
     if (output->damaged == 0 && buffer_age > 0) {
-        send_frame_done_to_layer(
-            &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND], &now);
-        send_frame_done_to_layer(
-            &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM], &now);
+        if (occluded) {
+            send_frame_done_to_occluded(output, &now);
+        } else {
+            send_frame_done_to_layer(
+                &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND], &now);
+            send_frame_done_to_layer(
+                &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM], &now);
+        }
         send_frame_done_to_layer(
             &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_TOP], &now);
         send_frame_done_to_layer(
             &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY], &now);
 
-        struct kiwmi_view *view;
-        wl_list_for_each (view, &desktop->views, link) {
-            view_for_each_surface(view, send_frame_done_to_surface, &now);
-        }
+        send_frame_done_to_views(desktop, &now);
 
         if (render_cursors(wlr_output)) {
             output_damage(output);
         }
 
         wlr_output_commit(wlr_output);
+        output_frame_done(output, &now);
         return;
     }
 
-    struct wlr_output_layout *output_layout = desktop->output_layout;
     struct kiwmi_server *server   = wl_container_of(desktop, server, desktop);
     struct wlr_renderer *renderer = server->renderer;
 
@@ -201,11 +331,6 @@ output_frame_notify(struct wl_listener *listener, void *data)
     wlr_renderer_begin(renderer, width, height);
     wlr_renderer_clear(renderer, desktop->bg_color);
 
-    double output_lx = 0;
-    double output_ly = 0;
-    wlr_output_layout_output_coords(
-        output_layout, wlr_output, &output_lx, &output_ly);
-
     struct kiwmi_render_data rdata = {
         .output    = output->wlr_output,
         .output_lx = output_lx,
@@ -214,8 +339,13 @@ output_frame_notify(struct wl_listener *listener, void *data)
         .when      = &now,
     };
 
-    render_layer(&output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND], &rdata);
-    render_layer(&output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM], &rdata);
+    if (occluded) {
+        send_frame_done_to_occluded(output, &now);
+    } else {
+        render_layer(
+            &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND], &rdata);
+        render_layer(&output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM], &rdata);
+    }
 
     struct kiwmi_view *view;
     wl_list_for_each_reverse (view, &desktop->views, link) {
@@ -230,6 +360,8 @@ output_frame_notify(struct wl_listener *listener, void *data)
         wl_signal_emit(&view->events.post_render, &rdata);
     }
 
+    send_frame_done_to_views(desktop, &now);
+
     render_layer(&output->layers[ZWLR_LAYER_SHELL_V1_LAYER_TOP], &rdata);
     render_layer(&output->layers[ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY], &rdata);
 
@@ -243,6 +375,7 @@ output_frame_notify(struct wl_listener *listener, void *data)
     }
 
     wlr_output_commit(wlr_output);
+    output_frame_done(output, &now);
 }
 
 static void
@@ -270,6 +403,7 @@ output_destroy_notify(struct wl_listener *listener, void *UNUSED(data))
     }
 
     wl_signal_emit(&output->events.destroy, output);
+    wl_signal_emit(&output->desktop->events.output_destroy, output);
 
     wl_list_remove(&output->link);
     wl_list_remove(&output->frame.link);
@@ -0,0 +1,402 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// for memfd_create and file sealing
+#define _GNU_SOURCE
+
+#include "desktop/snapshot.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <wayland-server.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_output_layout.h>
+#include <wlr/util/log.h>
+
+#include "desktop/desktop.h"
+#include "desktop/output.h"
+#include "desktop/view.h"
+
+/**
+ * Readers that see an odd sequence number wait for the write to end.
+ */
+static void
+snapshot_begin(struct kiwmi_snapshot_data *data)
+{
+    uint32_t seq = atomic_load_explicit(&data->seq, memory_order_relaxed);
+    atomic_store_explicit(&data->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void
+snapshot_end(struct kiwmi_snapshot_data *data)
+{
+    uint32_t seq = atomic_load_explicit(&data->seq, memory_order_relaxed);
+    atomic_store_explicit(&data->seq, seq + 1, memory_order_release);
+}
+
+/**
+ * Truncates at a character boundary, so readers never see half of one.
+ */
+static void
+snapshot_copy_string(char *dst, size_t size, const char *src)
+{
+    if (!src) {
+        src = "";
+    }
+
+    size_t len = strnlen(src, size);
+    if (len == size) {
+        len = size - 1;
+        while (len > 0 && (src[len] & 0xc0) == 0x80) {
+            --len;
+        }
+    }
+
+    memcpy(dst, src, len);
+    memset(dst + len, 0, size - len);
+}
+
+static void
+snapshot_write_view(
+    struct kiwmi_snapshot_view *entry,
+    struct kiwmi_view *view)
+{
+    entry->id              = (uint64_t)(size_t)view;
+    entry->geometry.x      = view->x;
+    entry->geometry.y      = view->y;
+    entry->geometry.width  = view->geom.width;
+    entry->geometry.height = view->geom.height;
+    entry->pid             = view_get_pid(view);
+    entry->reserved        = 0;
+
+    snapshot_copy_string(
+        entry->app_id, sizeof(entry->app_id), view_get_app_id(view));
+    snapshot_copy_string(
+        entry->title, sizeof(entry->title), view_get_title(view));
+}
+
+static struct kiwmi_snapshot_view *
+snapshot_find_view(struct kiwmi_snapshot *snapshot, struct kiwmi_view *view)
+{
+    uint64_t id = (uint64_t)(size_t)view;
+
+    for (uint32_t i = 0; i < snapshot->view_count; ++i) {
+        if (snapshot->data->views[i].id == id) {
+            return &snapshot->data->views[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+snapshot_set_view_count(struct kiwmi_snapshot *snapshot, uint32_t count)
+{
+    snapshot->view_count       = count;
+    snapshot->data->view_count = count;
+
+    if (snapshot->truncated) {
+        snapshot->data->flags |= KIWMI_SNAPSHOT_TRUNCATED;
+    } else {
+        snapshot->data->flags &= ~KIWMI_SNAPSHOT_TRUNCATED;
+    }
+}
+
+/**
+ * Adds the views that were left out while there was no room for them, as
+ * far as they fit now.
+ */
+static void
+snapshot_refill_views(struct kiwmi_snapshot *snapshot)
+{
+    uint32_t count      = snapshot->view_count;
+    snapshot->truncated = false;
+
+    struct kiwmi_view *view;
+    wl_list_for_each (view, &snapshot->desktop->views, link) {
+        if (!view->mapped || snapshot_find_view(snapshot, view)) {
+            continue;
+        }
+
+        if (count == KIWMI_SNAPSHOT_MAX_VIEWS) {
+            snapshot->truncated = true;
+            break;
+        }
+
+        snapshot_write_view(&snapshot->data->views[count++], view);
+        // so it is found by the next iteration already
+        snapshot->view_count = count;
+    }
+
+    snapshot_set_view_count(snapshot, count);
+}
+
+/**
+ * There are few enough outputs to rewrite all of them on each change.
+ */
+static void
+snapshot_write_outputs(struct kiwmi_snapshot *snapshot)
+{
+    struct kiwmi_snapshot_data *data = snapshot->data;
+
+    snapshot_begin(data);
+
+    uint32_t count = 0;
+
+    struct wlr_output_layout_output *l_output;
+    wl_list_for_each (
+        l_output, &snapshot->desktop->output_layout->outputs, link) {
+        if (count == KIWMI_SNAPSHOT_MAX_OUTPUTS) {
+            break;
+        }
+
+        struct wlr_output *wlr_output       = l_output->output;
+        struct kiwmi_output *output         = wlr_output->data;
+        struct kiwmi_snapshot_output *entry = &data->outputs[count++];
+
+        int width;
+        int height;
+        wlr_output_effective_resolution(wlr_output, &width, &height);
+
+        snapshot_copy_string(
+            entry->name, sizeof(entry->name), wlr_output->name);
+        entry->geometry.x      = l_output->x;
+        entry->geometry.y      = l_output->y;
+        entry->geometry.width  = width;
+        entry->geometry.height = height;
+
+        if (output) {
+            entry->usable_area.x      = output->usable_area.x;
+            entry->usable_area.y      = output->usable_area.y;
+            entry->usable_area.width  = output->usable_area.width;
+            entry->usable_area.height = output->usable_area.height;
+        } else {
+            memset(&entry->usable_area, 0, sizeof(entry->usable_area));
+        }
+    }
+
+    memset(
+        &data->outputs[count],
+        0,
+        (KIWMI_SNAPSHOT_MAX_OUTPUTS - count) * sizeof(data->outputs[0]));
+    snapshot->output_count = count;
+    data->output_count     = count;
+
+    snapshot_end(data);
+}
+
+static void
+snapshot_layout_change_notify(
+    struct wl_listener *listener,
+    void *UNUSED(data))
+{
+    struct kiwmi_snapshot *snapshot =
+        wl_container_of(listener, snapshot, layout_change);
+
+    snapshot_write_outputs(snapshot);
+}
+
+static void
+snapshot_usable_area_change_notify(
+    struct wl_listener *listener,
+    void *UNUSED(data))
+{
+    struct kiwmi_snapshot *snapshot =
+        wl_container_of(listener, snapshot, usable_area_change);
+
+    snapshot_write_outputs(snapshot);
+}
+
+static void
+snapshot_view_change_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_snapshot *snapshot =
+        wl_container_of(listener, snapshot, view_change);
+    struct kiwmi_view *view = data;
+
+    struct kiwmi_snapshot_view *entry = snapshot_find_view(snapshot, view);
+    if (!entry) {
+        return;
+    }
+
+    snapshot_begin(snapshot->data);
+    snapshot_write_view(entry, view);
+    snapshot_end(snapshot->data);
+}
+
+static void
+snapshot_view_focus_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_snapshot *snapshot =
+        wl_container_of(listener, snapshot, view_focus);
+
+    snapshot_begin(snapshot->data);
+    snapshot->data->focused_view = (uint64_t)(size_t)data;
+    snapshot_end(snapshot->data);
+}
+
+static void
+snapshot_view_map_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_snapshot *snapshot =
+        wl_container_of(listener, snapshot, view_map);
+    struct kiwmi_snapshot_data *snapshot_data = snapshot->data;
+
+    uint32_t count = snapshot->view_count;
+
+    snapshot_begin(snapshot_data);
+
+    if (count < KIWMI_SNAPSHOT_MAX_VIEWS) {
+        snapshot_write_view(&snapshot_data->views[count++], data);
+    } else {
+        snapshot->truncated = true;
+    }
+    snapshot_set_view_count(snapshot, count);
+
+    snapshot_end(snapshot_data);
+}
+
+/**
+ * The last view takes the place of the unmapped one, or one that didn't fit
+ * before.
+ */
+static void
+snapshot_view_unmap_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_snapshot *snapshot =
+        wl_container_of(listener, snapshot, view_unmap);
+    struct kiwmi_snapshot_data *snapshot_data = snapshot->data;
+
+    struct kiwmi_snapshot_view *entry = snapshot_find_view(snapshot, data);
+    if (!entry) {
+        return;
+    }
+
+    struct kiwmi_snapshot_view *last =
+        &snapshot_data->views[snapshot->view_count - 1];
+
+    snapshot_begin(snapshot_data);
+
+    if (entry != last) {
+        memcpy(entry, last, sizeof(*entry));
+    }
+    memset(last, 0, sizeof(*last));
+    snapshot_set_view_count(snapshot, snapshot->view_count - 1);
+
+    if (snapshot->truncated) {
+        snapshot_refill_views(snapshot);
+    }
+
+    snapshot_end(snapshot_data);
+}
+
+static bool
+snapshot_create_memfd(struct kiwmi_snapshot *snapshot)
+{
+    size_t size = sizeof(*snapshot->data);
+
+    snapshot->fd =
+        memfd_create("kiwmi-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (snapshot->fd < 0) {
+        return false;
+    }
+
+    if (ftruncate(snapshot->fd, size)) {
+        close(snapshot->fd);
+        return false;
+    }
+
+    void *data = mmap(
+        NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, snapshot->fd, 0);
+    if (data == MAP_FAILED) {
+        close(snapshot->fd);
+        return false;
+    }
+
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+    // only the mapping above stays writable, readers can't scribble on it
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+
+    // older kernels reject unknown seals, and apply none of them
+    if (fcntl(snapshot->fd, F_ADD_SEALS, seals) < 0) {
+        wlr_log_errno(WLR_ERROR, "Failed to seal state snapshot");
+        munmap(data, size);
+        close(snapshot->fd);
+        return false;
+    }
+
+    snapshot->data = data;
+
+    return true;
+}
+
+void
+snapshot_init(struct kiwmi_snapshot *snapshot, struct kiwmi_desktop *desktop)
+{
+    snapshot->desktop      = desktop;
+    snapshot->fd           = -1;
+    snapshot->data         = NULL;
+    snapshot->output_count = 0;
+    snapshot->view_count   = 0;
+    snapshot->truncated    = false;
+
+    // the compositor works fine without it, it just can't be handed out
+    if (!snapshot_create_memfd(snapshot)) {
+        wlr_log(WLR_ERROR, "Failed to create state snapshot");
+        return;
+    }
+
+    snapshot->data->magic   = KIWMI_SNAPSHOT_MAGIC;
+    snapshot->data->version = KIWMI_SNAPSHOT_VERSION;
+
+    snapshot->layout_change.notify = snapshot_layout_change_notify;
+    wl_signal_add(
+        &desktop->output_layout->events.change, &snapshot->layout_change);
+
+    snapshot->usable_area_change.notify = snapshot_usable_area_change_notify;
+    wl_signal_add(
+        &desktop->events.usable_area_change, &snapshot->usable_area_change);
+
+    snapshot->view_change.notify = snapshot_view_change_notify;
+    wl_signal_add(&desktop->events.view_change, &snapshot->view_change);
+
+    snapshot->view_focus.notify = snapshot_view_focus_notify;
+    wl_signal_add(&desktop->events.view_focus, &snapshot->view_focus);
+
+    snapshot->view_map.notify = snapshot_view_map_notify;
+    wl_signal_add(&desktop->events.view_map, &snapshot->view_map);
+
+    snapshot->view_unmap.notify = snapshot_view_unmap_notify;
+    wl_signal_add(&desktop->events.view_unmap, &snapshot->view_unmap);
+}
+
+void
+snapshot_fini(struct kiwmi_snapshot *snapshot)
+{
+    if (!snapshot->data) {
+        return;
+    }
+
+    wl_list_remove(&snapshot->layout_change.link);
+    wl_list_remove(&snapshot->usable_area_change.link);
+    wl_list_remove(&snapshot->view_change.link);
+    wl_list_remove(&snapshot->view_focus.link);
+    wl_list_remove(&snapshot->view_map.link);
+    wl_list_remove(&snapshot->view_unmap.link);
+
+    munmap(snapshot->data, sizeof(*snapshot->data));
+    close(snapshot->fd);
+    snapshot->data = NULL;
+}
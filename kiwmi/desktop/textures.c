@@ -0,0 +1,202 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "desktop/textures.h"
+
+#include <wayland-server.h>
+#include <wlr/render/wlr_texture.h>
+#include <wlr/types/wlr_surface.h>
+
+#include "desktop/desktop.h"
+#include "desktop/view.h"
+#include "server.h"
+
+#define TEXTURES_HIDDEN_TIMEOUT 60000000000ull // ns
+#define TEXTURE_BYTES_PER_PIXEL 4              // an estimate, good for ARGB
+
+static void
+texture_size_add(
+    struct wlr_surface *surface,
+    int UNUSED(sx),
+    int UNUSED(sy),
+    void *data)
+{
+    size_t *size = data;
+
+    struct wlr_texture *texture = wlr_surface_get_texture(surface);
+    if (texture) {
+        *size +=
+            (size_t)texture->width * texture->height * TEXTURE_BYTES_PER_PIXEL;
+    }
+}
+
+/**
+ * Estimates the memory taken by the textures of all surfaces of 'view'.
+ */
+size_t
+textures_view_size(struct kiwmi_view *view)
+{
+    size_t size = 0;
+
+    if (view->mapped) {
+        view_for_each_surface(view, texture_size_add, &size);
+    }
+
+    return size;
+}
+
+size_t
+textures_size(struct kiwmi_textures *textures, bool hidden_only)
+{
+    size_t size = 0;
+
+    struct kiwmi_view *view;
+    wl_list_for_each (view, &textures->desktop->views, link) {
+        if (!hidden_only || view->hidden) {
+            size += textures_view_size(view);
+        }
+    }
+
+    return size;
+}
+
+/**
+ * wlroots 0.15 has no way to drop the texture of a committed buffer, so a
+ * parked view only stops getting frame done events. That keeps its client
+ * from drawing and allocating new buffers until it's shown.
+ */
+void
+textures_view_park(struct kiwmi_view *view)
+{
+    if (view->parked || !view->mapped) {
+        return;
+    }
+
+    view->parked = true;
+    view_set_suspended(view, true);
+}
+
+/**
+ * The next output frame sends the view a frame done again.
+ */
+void
+textures_view_unpark(struct kiwmi_view *view)
+{
+    view->parked = false;
+}
+
+/**
+ * Applies the policy again if the view's textures changed in size, and
+ * keeps track of it for the next commit.
+ */
+void
+textures_view_commit(struct kiwmi_view *view)
+{
+    size_t size = textures_view_size(view);
+    if (size == view->textures_size) {
+        return;
+    }
+
+    view->textures_size = size;
+    if (view->desktop->textures.budget) {
+        textures_update(&view->desktop->textures);
+    }
+}
+
+/**
+ * The hidden view that has been hidden the longest and isn't parked yet.
+ */
+static struct kiwmi_view *
+textures_oldest_hidden(struct kiwmi_textures *textures)
+{
+    struct kiwmi_view *oldest = NULL;
+
+    struct kiwmi_view *view;
+    wl_list_for_each (view, &textures->desktop->views, link) {
+        if (!view->hidden || !view->mapped || view->parked) {
+            continue;
+        }
+
+        if (!oldest || view->hidden_since < oldest->hidden_since) {
+            oldest = view;
+        }
+    }
+
+    return oldest;
+}
+
+static void
+textures_timer(struct kiwmi_timer *UNUSED(timer), void *data)
+{
+    struct kiwmi_textures *textures = data;
+
+    uint64_t now  = timer_now();
+    uint64_t next = UINT64_MAX;
+
+    struct kiwmi_view *view;
+    while (textures->hidden_timeout
+           && (view = textures_oldest_hidden(textures))) {
+        uint64_t deadline = view->hidden_since + textures->hidden_timeout;
+        if (deadline < view->hidden_since) {
+            deadline = UINT64_MAX;
+        }
+        if (deadline > now) {
+            next = deadline - now;
+            break;
+        }
+
+        textures_view_park(view);
+    }
+
+    // parked views don't draw anymore, the others have to fit
+    if (textures->budget) {
+        size_t size = textures_size(textures, false);
+        wl_list_for_each (view, &textures->desktop->views, link) {
+            if (view->parked) {
+                size -= textures_view_size(view);
+            }
+        }
+
+        while (size > textures->budget
+               && (view = textures_oldest_hidden(textures))) {
+            size -= textures_view_size(view);
+            textures_view_park(view);
+        }
+    }
+
+    if (next != UINT64_MAX) {
+        timer_arm(&textures->timer, next, 0);
+    }
+}
+
+/**
+ * Applies the policy again soon, after a view has been hidden or mapped, its
+ * textures changed in size or the policy changed.
+ */
+void
+textures_update(struct kiwmi_textures *textures)
+{
+    timer_arm(&textures->timer, 0, 0);
+}
+
+void
+textures_init(struct kiwmi_textures *textures, struct kiwmi_desktop *desktop)
+{
+    struct kiwmi_server *server = wl_container_of(desktop, server, desktop);
+
+    textures->desktop        = desktop;
+    textures->hidden_timeout = TEXTURES_HIDDEN_TIMEOUT;
+    textures->budget         = 0;
+
+    timer_init(&textures->timer, &server->timers, textures_timer, textures);
+}
+
+void
+textures_fini(struct kiwmi_textures *textures)
+{
+    timer_disarm(&textures->timer);
+}
@@ -7,6 +7,9 @@
 
 #include "desktop/view.h"
 
+#include <stdint.h>
+
+#include <pixman.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/util/log.h>
 
@@ -23,17 +26,74 @@ view_close(struct kiwmi_view *view)
     }
 }
 
+static void
+view_surfaces_append(struct wlr_surface *surface, int sx, int sy, void *data)
+{
+    struct kiwmi_view *view = data;
+
+    if (view->surfaces_len == view->surfaces_capacity) {
+        size_t capacity =
+            view->surfaces_capacity ? view->surfaces_capacity * 2 : 4;
+        struct kiwmi_view_surface *grown =
+            realloc(view->surfaces, capacity * sizeof(*grown));
+        if (!grown) {
+            // try again next time
+            view->surfaces_dirty = true;
+            return;
+        }
+
+        view->surfaces          = grown;
+        view->surfaces_capacity = capacity;
+    }
+
+    struct kiwmi_view_surface *entry = &view->surfaces[view->surfaces_len++];
+
+    entry->surface = surface;
+    entry->sx      = sx;
+    entry->sy      = sy;
+}
+
+/**
+ * Walks the flattened surface tree, which is only traversed again after
+ * view_surfaces_invalidate().
+ */
 void
 view_for_each_surface(
     struct kiwmi_view *view,
     wlr_surface_iterator_func_t callback,
     void *user_data)
 {
-    if (view->impl->for_each_surface) {
+    if (!view->impl->for_each_surface) {
+        return;
+    }
+
+    if (view->surfaces_dirty) {
+        view->surfaces_len   = 0;
+        view->surfaces_dirty = false;
+        view->impl->for_each_surface(view, view_surfaces_append, view);
+    }
+
+    if (view->surfaces_dirty) {
         view->impl->for_each_surface(view, callback, user_data);
+        return;
+    }
+
+    for (size_t i = 0; i < view->surfaces_len; ++i) {
+        struct kiwmi_view_surface *entry = &view->surfaces[i];
+        callback(entry->surface, entry->sx, entry->sy, user_data);
     }
 }
 
+/**
+ * To be called whenever a surface of the view has been added, removed,
+ * mapped, unmapped or moved relative to the others.
+ */
+void
+view_surfaces_invalidate(struct kiwmi_view *view)
+{
+    view->surfaces_dirty = true;
+}
+
 pid_t
 view_get_pid(struct kiwmi_view *view)
 {
@@ -79,6 +139,42 @@ view_set_activated(struct kiwmi_view *view, bool activated)
     }
 }
 
+/**
+ * Hidden views aren't rendered, and only get a frame done every now and then
+ * (see output.c).
+ */
+void
+view_set_hidden(struct kiwmi_view *view, bool hidden)
+{
+    if (view->hidden == hidden) {
+        return;
+    }
+
+    view->hidden = hidden;
+
+    struct kiwmi_desktop *desktop = view->desktop;
+
+    if (hidden) {
+        view->hidden_since = timer_now();
+        textures_update(&desktop->textures);
+    } else {
+        textures_view_unpark(view);
+    }
+
+    if (!view->mapped) {
+        return;
+    }
+
+    struct kiwmi_server *server   = wl_container_of(desktop, server, desktop);
+    struct kiwmi_cursor *cursor   = server->input.cursor;
+    cursor_refresh_focus(cursor, NULL, NULL, NULL);
+
+    struct kiwmi_output *output;
+    wl_list_for_each (output, &desktop->outputs, link) {
+        output_damage(output);
+    }
+}
+
 void
 view_set_size(struct kiwmi_view *view, uint32_t width, uint32_t height)
 {
@@ -121,6 +217,26 @@ view_set_pos(struct kiwmi_view *view, uint32_t x, uint32_t y)
     wl_list_for_each (output, &desktop->outputs, link) {
         output_damage(output);
     }
+
+    wl_signal_emit(&desktop->events.view_change, view);
+}
+
+/**
+ * Lets the client know whether it can be seen, if the shell supports it.
+ * None does yet, xdg_toplevel.suspended needs a newer wlroots.
+ */
+void
+view_set_suspended(struct kiwmi_view *view, bool suspended)
+{
+    if (view->suspended == suspended) {
+        return;
+    }
+
+    view->suspended = suspended;
+
+    if (view->impl->set_suspended) {
+        view->impl->set_suspended(view, suspended);
+    }
 }
 
 void
@@ -196,6 +312,73 @@ view_at(
     return NULL;
 }
 
+static void
+view_extents_add(struct wlr_surface *surface, int sx, int sy, void *data)
+{
+    pixman_box32_t *extents = data;
+
+    int x2 = sx + surface->current.width;
+    int y2 = sy + surface->current.height;
+
+    extents->x1 = sx < extents->x1 ? sx : extents->x1;
+    extents->y1 = sy < extents->y1 ? sy : extents->y1;
+    extents->x2 = x2 > extents->x2 ? x2 : extents->x2;
+    extents->y2 = y2 > extents->y2 ? y2 : extents->y2;
+}
+
+/**
+ * Whether a single view above covers all surfaces of this one with opaque
+ * content.
+ */
+bool
+view_is_occluded(struct kiwmi_view *view)
+{
+    pixman_box32_t extents = {
+        .x1 = INT32_MAX,
+        .y1 = INT32_MAX,
+        .x2 = INT32_MIN,
+        .y2 = INT32_MIN,
+    };
+    view_for_each_surface(view, view_extents_add, &extents);
+
+    if (extents.x1 >= extents.x2 || extents.y1 >= extents.y2) {
+        return false;
+    }
+
+    // in layout coordinates
+    int lx = view->x - view->geom.x;
+    int ly = view->y - view->geom.y;
+
+    struct kiwmi_desktop *desktop = view->desktop;
+
+    // views are kept from top to bottom
+    for (struct wl_list *pos = view->link.prev; pos != &desktop->views;
+         pos = pos->prev) {
+        struct kiwmi_view *above = wl_container_of(pos, above, link);
+        if (above->hidden || !above->mapped || !above->wlr_surface) {
+            continue;
+        }
+
+        int above_lx = above->x - above->geom.x;
+        int above_ly = above->y - above->geom.y;
+
+        pixman_box32_t box = {
+            .x1 = extents.x1 + lx - above_lx,
+            .y1 = extents.y1 + ly - above_ly,
+            .x2 = extents.x2 + lx - above_lx,
+            .y2 = extents.y2 + ly - above_ly,
+        };
+
+        if (pixman_region32_contains_rectangle(
+                &above->wlr_surface->opaque_region, &box)
+            == PIXMAN_REGION_IN) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static void
 view_begin_interactive(
     struct kiwmi_view *view,
@@ -289,8 +472,21 @@ view_create(
     view->impl       = impl;
     view->mapped     = false;
     view->hidden     = true;
+    view->suspended  = false;
     view->decoration = NULL;
 
+    view->keepalive_frame.tv_sec  = 0;
+    view->keepalive_frame.tv_nsec = 0;
+
+    view->hidden_since  = timer_now();
+    view->textures_size = 0;
+    view->parked        = false;
+
+    view->surfaces          = NULL;
+    view->surfaces_len      = 0;
+    view->surfaces_capacity = 0;
+    view->surfaces_dirty    = true;
+
     view->x = 0;
     view->y = 0;
 
@@ -341,6 +537,8 @@ view_child_destroy(struct kiwmi_view_child *child)
         view_child_damage(child);
     }
 
+    view_surfaces_invalidate(child->view);
+
     wl_list_remove(&child->link);
     child->parent = NULL;
 
@@ -381,12 +579,76 @@ view_child_surface_destroy_notify(
     view_child_destroy(child);
 }
 
+/**
+ * Whether the child has been moved or restacked since it was last seen.
+ */
+static bool
+view_child_moved(struct kiwmi_view_child *child)
+{
+    int32_t x;
+    int32_t y;
+    struct wl_list *below = NULL;
+
+    switch (child->type) {
+    case KIWMI_VIEW_CHILD_SUBSURFACE:
+        x     = child->wlr_subsurface->current.x;
+        y     = child->wlr_subsurface->current.y;
+        below = child->wlr_subsurface->current.link.prev;
+        break;
+    case KIWMI_VIEW_CHILD_XDG_POPUP:
+        x = child->wlr_xdg_popup->geometry.x;
+        y = child->wlr_xdg_popup->geometry.y;
+        break;
+    default:
+        return false;
+    }
+
+    if (x == child->x && y == child->y && below == child->below) {
+        return false;
+    }
+
+    child->x     = x;
+    child->y     = y;
+    child->below = below;
+
+    return true;
+}
+
+/**
+ * Invalidates the cached surfaces if any of 'children' has been moved or
+ * restacked, which their parent applies when it is committed. Any change of
+ * the stacking order changes what comes before one of them.
+ */
+void
+view_children_check_moved(struct kiwmi_view *view, struct wl_list *children)
+{
+    bool moved = false;
+
+    struct kiwmi_view_child *child;
+    wl_list_for_each (child, children, link) {
+        // all of them, so the next check starts from the current state
+        moved |= view_child_moved(child);
+    }
+
+    if (moved) {
+        view_surfaces_invalidate(view);
+    }
+}
+
 static void
 view_child_commit_notify(struct wl_listener *listener, void *UNUSED(data))
 {
     struct kiwmi_view_child *child = wl_container_of(listener, child, commit);
+
+    // popups are repositioned on their own commits
+    if (child->type == KIWMI_VIEW_CHILD_XDG_POPUP && view_child_moved(child)) {
+        view_surfaces_invalidate(child->view);
+    }
+    view_children_check_moved(child->view, &child->children);
+
     if (view_child_is_mapped(child)) {
         view_child_damage(child);
+        textures_view_commit(child->view);
     }
 }
 
@@ -404,6 +666,7 @@ view_child_map_notify(struct wl_listener *listener, void *UNUSED(data))
 {
     struct kiwmi_view_child *child = wl_container_of(listener, child, map);
     child->mapped                  = true;
+    view_surfaces_invalidate(child->view);
     if (view_child_is_mapped(child)) {
         view_child_damage(child);
     }
@@ -417,6 +680,7 @@ view_child_unmap_notify(struct wl_listener *listener, void *UNUSED(data))
         view_child_damage(child);
     }
     child->mapped = false;
+    view_surfaces_invalidate(child->view);
 }
 
 struct kiwmi_view_child *
@@ -448,6 +712,8 @@ view_child_create(
 
     wl_list_init(&child->children);
 
+    view_surfaces_invalidate(view);
+
     child->commit.notify = view_child_commit_notify;
     wl_signal_add(&wlr_surface->events.commit, &child->commit);
 
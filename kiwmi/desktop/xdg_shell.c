@@ -7,6 +7,8 @@
 
 #include "desktop/xdg_shell.h"
 
+#include <string.h>
+
 #include <unistd.h>
 
 #include <pixman.h>
@@ -174,6 +176,14 @@ xdg_surface_map_notify(struct wl_listener *listener, void *UNUSED(data))
 {
     struct kiwmi_view *view = wl_container_of(listener, view, map);
     view->mapped            = true;
+    view_surfaces_invalidate(view);
+
+    // views mapped hidden are up to the policy from now on
+    if (view->hidden) {
+        view->hidden_since = timer_now();
+    }
+    textures_view_commit(view);
+    textures_update(&view->desktop->textures);
 
     struct kiwmi_output *output;
     wl_list_for_each (output, &view->desktop->outputs, link) {
@@ -190,6 +200,7 @@ xdg_surface_unmap_notify(struct wl_listener *listener, void *UNUSED(data))
 
     if (view->mapped) {
         view->mapped = false;
+        view_surfaces_invalidate(view);
 
         struct kiwmi_output *output;
         wl_list_for_each (output, &view->desktop->outputs, link) {
@@ -197,6 +208,7 @@ xdg_surface_unmap_notify(struct wl_listener *listener, void *UNUSED(data))
         }
 
         wl_signal_emit(&view->events.unmap, view);
+        wl_signal_emit(&view->desktop->events.view_unmap, view);
     }
 }
 
@@ -210,14 +222,28 @@ xdg_surface_commit_notify(struct wl_listener *listener, void *UNUSED(data))
     struct kiwmi_cursor *cursor   = server->input.cursor;
     cursor_refresh_focus(cursor, NULL, NULL, NULL);
 
+    // subsurface positions and stacking are applied with the parent
+    view_children_check_moved(view, &view->children);
+
     if (pixman_region32_not_empty(&view->wlr_surface->buffer_damage)) {
         struct kiwmi_output *output;
         wl_list_for_each (output, &desktop->outputs, link) {
             output_damage(output);
         }
+
+        textures_view_commit(view);
     }
 
+    struct wlr_box geom = view->geom;
     wlr_xdg_surface_get_geometry(view->xdg_surface, &view->geom);
+
+    if (memcmp(&geom, &view->geom, sizeof(geom)) != 0) {
+        // popups are placed relative to the geometry
+        if (!wl_list_empty(&view->children)) {
+            view_surfaces_invalidate(view);
+        }
+        wl_signal_emit(&desktop->events.view_change, view);
+    }
 }
 
 static void
@@ -230,6 +256,7 @@ xdg_surface_destroy_notify(struct wl_listener *listener, void *UNUSED(data))
 
     if (seat->focused_view == view) {
         seat->focused_view = NULL;
+        wl_signal_emit(&desktop->events.view_focus, NULL);
     }
     cursor_refresh_focus(server->input.cursor, NULL, NULL, NULL);
 
@@ -253,9 +280,12 @@ xdg_surface_destroy_notify(struct wl_listener *listener, void *UNUSED(data))
     wl_list_remove(&view->new_subsurface.link);
     wl_list_remove(&view->request_move.link);
     wl_list_remove(&view->request_resize.link);
+    wl_list_remove(&view->set_title.link);
+    wl_list_remove(&view->set_app_id.link);
 
     wl_list_remove(&view->events.unmap.listener_list);
 
+    free(view->surfaces);
     free(view);
 }
 
@@ -283,6 +313,24 @@ xdg_toplevel_request_resize_notify(struct wl_listener *listener, void *data)
     wl_signal_emit(&view->events.request_resize, &new_event);
 }
 
+static void
+xdg_toplevel_set_title_notify(struct wl_listener *listener, void *UNUSED(data))
+{
+    struct kiwmi_view *view = wl_container_of(listener, view, set_title);
+
+    wl_signal_emit(&view->desktop->events.view_change, view);
+}
+
+static void
+xdg_toplevel_set_app_id_notify(
+    struct wl_listener *listener,
+    void *UNUSED(data))
+{
+    struct kiwmi_view *view = wl_container_of(listener, view, set_app_id);
+
+    wl_signal_emit(&view->desktop->events.view_change, view);
+}
+
 static void
 xdg_shell_view_close(struct kiwmi_view *view)
 {
@@ -429,6 +477,13 @@ xdg_shell_new_surface_notify(struct wl_listener *listener, void *data)
     wl_signal_add(
         &xdg_surface->toplevel->events.request_resize, &view->request_resize);
 
+    view->set_title.notify = xdg_toplevel_set_title_notify;
+    wl_signal_add(&xdg_surface->toplevel->events.set_title, &view->set_title);
+
+    view->set_app_id.notify = xdg_toplevel_set_app_id_notify;
+    wl_signal_add(
+        &xdg_surface->toplevel->events.set_app_id, &view->set_app_id);
+
     view_init_subsurfaces(NULL, view);
 
     wl_list_insert(&desktop->views, &view->link);
@@ -68,9 +68,17 @@ seat_focus_layer(struct kiwmi_seat *seat, struct kiwmi_layer *layer)
 void
 seat_focus_view(struct kiwmi_seat *seat, struct kiwmi_view *view)
 {
+    struct kiwmi_input *input   = seat->input;
+    struct kiwmi_server *server = wl_container_of(input, server, input);
+
+    bool changed = seat->focused_view != view;
+
     if (!view) {
         seat_focus_surface(seat, NULL);
         seat->focused_view = NULL;
+        if (changed) {
+            wl_signal_emit(&server->desktop.events.view_focus, NULL);
+        }
         return;
     }
 
@@ -88,6 +96,10 @@ seat_focus_view(struct kiwmi_seat *seat, struct kiwmi_view *view)
     seat->focused_view = view;
     view_set_activated(view, true);
     seat_focus_surface(seat, view->wlr_surface);
+
+    if (changed) {
+        wl_signal_emit(&desktop->events.view_focus, view);
+    }
 }
 
 static void
@@ -0,0 +1,277 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "luak/allocator.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+#define CHUNK_SIZE   (64 * 1024)
+#define POOLED_LIMIT (KIWMI_ALLOCATOR_CLASSES * KIWMI_ALLOCATOR_GRANULE)
+
+// padded to the granule, so blocks keep the alignment of malloc()
+struct kiwmi_allocator_chunk {
+    struct kiwmi_allocator_chunk *next;
+    char padding[KIWMI_ALLOCATOR_GRANULE - sizeof(void *)];
+};
+
+void
+luaK_allocator_init(struct kiwmi_allocator *allocator)
+{
+    for (size_t i = 0; i < KIWMI_ALLOCATOR_CLASSES; ++i) {
+        allocator->free_lists[i] = NULL;
+    }
+
+    allocator->chunks    = NULL;
+    allocator->bump      = NULL;
+    allocator->bump_left = 0;
+
+    allocator->live        = 0;
+    allocator->peak        = 0;
+    allocator->pooled      = 0;
+    allocator->requested   = 0;
+    allocator->allocations = 0;
+
+    allocator->rate_start       = timer_now();
+    allocator->rate_allocations = 0;
+    allocator->rate             = 0;
+}
+
+/**
+ * Must only be called after the Lua state using it has been closed.
+ */
+void
+luaK_allocator_fini(struct kiwmi_allocator *allocator)
+{
+    struct kiwmi_allocator_chunk *chunk = allocator->chunks;
+    while (chunk) {
+        struct kiwmi_allocator_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    luaK_allocator_init(allocator);
+}
+
+static bool
+size_pooled(size_t size)
+{
+    return size <= POOLED_LIMIT;
+}
+
+static size_t
+size_class(size_t size)
+{
+    return (size - 1) / KIWMI_ALLOCATOR_GRANULE;
+}
+
+static void
+pool_push(struct kiwmi_allocator *allocator, void *block, size_t class)
+{
+    *(void **)block              = allocator->free_lists[class];
+    allocator->free_lists[class] = block;
+}
+
+static bool
+pool_grow(struct kiwmi_allocator *allocator)
+{
+    struct kiwmi_allocator_chunk *chunk = malloc(CHUNK_SIZE);
+    if (!chunk) {
+        return false;
+    }
+
+    // hand the tail of the previous chunk to the smaller classes
+    while (allocator->bump_left >= KIWMI_ALLOCATOR_GRANULE) {
+        size_t class = allocator->bump_left / KIWMI_ALLOCATOR_GRANULE - 1;
+        if (class >= KIWMI_ALLOCATOR_CLASSES) {
+            class = KIWMI_ALLOCATOR_CLASSES - 1;
+        }
+
+        size_t size = (class + 1) * KIWMI_ALLOCATOR_GRANULE;
+        pool_push(allocator, allocator->bump, class);
+        allocator->bump += size;
+        allocator->bump_left -= size;
+    }
+
+    chunk->next       = allocator->chunks;
+    allocator->chunks = chunk;
+
+    allocator->bump      = (char *)(chunk + 1);
+    allocator->bump_left = CHUNK_SIZE - sizeof(*chunk);
+    allocator->pooled += CHUNK_SIZE;
+
+    return true;
+}
+
+static void *
+block_alloc(struct kiwmi_allocator *allocator, size_t size)
+{
+    if (!size_pooled(size)) {
+        return malloc(size);
+    }
+
+    size_t class = size_class(size);
+
+    void *block = allocator->free_lists[class];
+    if (block) {
+        allocator->free_lists[class] = *(void **)block;
+        return block;
+    }
+
+    size_t class_size = (class + 1) * KIWMI_ALLOCATOR_GRANULE;
+    if (allocator->bump_left < class_size && !pool_grow(allocator)) {
+        return NULL;
+    }
+
+    block = allocator->bump;
+    allocator->bump += class_size;
+    allocator->bump_left -= class_size;
+
+    return block;
+}
+
+static void
+block_free(struct kiwmi_allocator *allocator, void *block, size_t size)
+{
+    if (!block) {
+        return;
+    }
+
+    if (size_pooled(size)) {
+        pool_push(allocator, block, size_class(size));
+    } else {
+        free(block);
+    }
+}
+
+/**
+ * Lua can't cope with a failed shrink, so a malloc()ed block shrunk to a
+ * pooled size when the pools are out of memory is realloc()ed into a chunk
+ * of its own instead. It ends up in the pools once freed, and the
+ * chunk is freed along with the others.
+ */
+static void *
+block_adopt(struct kiwmi_allocator *allocator, void *ptr, size_t size)
+{
+    size_t class_size = (size_class(size) + 1) * KIWMI_ALLOCATOR_GRANULE;
+    size_t chunk_size = sizeof(struct kiwmi_allocator_chunk) + class_size;
+
+    struct kiwmi_allocator_chunk *chunk = realloc(ptr, chunk_size);
+    if (!chunk) {
+        return NULL;
+    }
+
+    memmove(chunk + 1, chunk, size);
+
+    chunk->next       = allocator->chunks;
+    allocator->chunks = chunk;
+    allocator->pooled += chunk_size;
+
+    return chunk + 1;
+}
+
+/**
+ * A lua_Alloc that serves the small tables, strings and userdata the event
+ * handlers churn through from per size class free lists. Lua passes the size
+ * of every block it frees or resizes, so blocks need no header.
+ */
+void *
+luaK_allocator_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    struct kiwmi_allocator *allocator = ud;
+
+    // without a block, osize encodes the type of the new object
+    if (!ptr) {
+        osize = 0;
+    }
+
+    if (nsize == 0) {
+        block_free(allocator, ptr, osize);
+        allocator->live -= osize;
+        return NULL;
+    }
+
+    void *block;
+    if (ptr && !size_pooled(osize) && !size_pooled(nsize)) {
+        block = realloc(ptr, nsize);
+    } else if (
+        ptr && size_pooled(osize) && size_pooled(nsize)
+        && size_class(osize) == size_class(nsize)) {
+        block = ptr;
+    } else {
+        block = block_alloc(allocator, nsize);
+        if (block && ptr) {
+            memcpy(block, ptr, osize < nsize ? osize : nsize);
+            block_free(allocator, ptr, osize);
+        } else if (ptr && nsize <= osize && !size_pooled(osize)) {
+            block = block_adopt(allocator, ptr, nsize);
+        }
+    }
+
+    // Lua can't cope with a failed shrink, keep the larger block instead. A
+    // pooled one is freed with its chunk, a malloc()ed one only gets here if
+    // even growing it by a header failed, and is leaked once freed.
+    if (!block && ptr && nsize <= osize) {
+        block = ptr;
+    }
+
+    if (!block) {
+        return NULL;
+    }
+
+    if (!ptr) {
+        ++allocator->allocations;
+    }
+
+    if (nsize > osize) {
+        allocator->requested += nsize - osize;
+    }
+
+    allocator->live = allocator->live - osize + nsize;
+    if (allocator->live > allocator->peak) {
+        allocator->peak = allocator->live;
+    }
+
+    return block;
+}
+
+static void
+push_field(lua_State *L, const char *name, lua_Number value)
+{
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, name);
+}
+
+/**
+ * The allocation rate is averaged over windows of at least a second, which
+ * are closed when the statistics are read.
+ */
+void
+luaK_allocator_push_stats(struct kiwmi_allocator *allocator, lua_State *L)
+{
+    uint64_t now     = timer_now();
+    uint64_t elapsed = now - allocator->rate_start;
+
+    if (elapsed >= 1000000000ull) {
+        uint64_t allocations = allocator->allocations;
+        allocator->rate =
+            (allocations - allocator->rate_allocations) * 1e9 / elapsed;
+
+        allocator->rate_start       = now;
+        allocator->rate_allocations = allocations;
+    }
+
+    lua_createtable(L, 0, 5);
+    push_field(L, "live", allocator->live);
+    push_field(L, "peak", allocator->peak);
+    push_field(L, "pooled", allocator->pooled);
+    push_field(L, "allocations", allocator->allocations);
+    push_field(L, "allocations_per_second", allocator->rate);
+}
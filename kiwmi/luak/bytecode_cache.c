@@ -0,0 +1,384 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// for realpath
+#define _XOPEN_SOURCE 700
+
+#include "luak/bytecode_cache.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lauxlib.h>
+#include <wlr/util/log.h>
+
+#include "luak/lua_compat.h"
+
+#define CACHE_MAGIC "KIWMIBC\1"
+// bytecode is only valid for the Lua it was dumped by
+#define CACHE_VERSION KIWMI_VERSION " " LUA_RELEASE
+
+struct cache_header {
+    char magic[8];
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t path_len;
+    uint32_t version_len;
+};
+
+struct dump_buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+static bool
+cache_dir(char *dir, size_t size)
+{
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home       = getenv("HOME");
+
+    int len;
+    if (cache_home && cache_home[0]) {
+        len = snprintf(dir, size, "%s/kiwmi", cache_home);
+    } else if (home && home[0]) {
+        len = snprintf(dir, size, "%s/.cache/kiwmi", home);
+    } else {
+        return false;
+    }
+
+    return len > 0 && (size_t)len < size;
+}
+
+/**
+ * Names the cache file after a hash of the source's real path.
+ */
+static bool
+cache_path(const char *source, char *path, size_t size)
+{
+    char dir[PATH_MAX];
+    if (!cache_dir(dir, sizeof(dir))) {
+        return false;
+    }
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *c = source; *c; ++c) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ull;
+    }
+
+    int len =
+        snprintf(path, size, "%s/%016llx.luac", dir, (unsigned long long)hash);
+
+    return len > 0 && (size_t)len < size;
+}
+
+static void
+cache_mkdir(const char *path)
+{
+    char dir[PATH_MAX];
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+
+    // the cache directory and its parent, e.g. ~/.cache
+    for (int i = 0; i < 2; ++i) {
+        char *slash = strrchr(dir, '/');
+        if (!slash || slash == dir) {
+            return;
+        }
+        *slash = '\0';
+    }
+
+    mkdir(dir, 0700);
+    *strchr(dir, '\0') = '/';
+    mkdir(dir, 0700);
+}
+
+static void
+header_init(
+    struct cache_header *header,
+    const char *source,
+    const struct stat *st)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->mtime_sec   = st->st_mtim.tv_sec;
+    header->mtime_nsec  = st->st_mtim.tv_nsec;
+    header->size        = st->st_size;
+    header->path_len    = strlen(source);
+    header->version_len = strlen(CACHE_VERSION);
+}
+
+static bool
+stat_equal(const struct stat *a, const struct stat *b)
+{
+    return a->st_mtim.tv_sec == b->st_mtim.tv_sec
+        && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+        && a->st_size == b->st_size;
+}
+
+/**
+ * Pushes the cached chunk if it was compiled from the current version of
+ * 'source', by this build of kiwmi.
+ */
+static bool
+cache_load(
+    lua_State *L,
+    const char *filename,
+    const char *source,
+    const char *path,
+    const struct stat *st)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    struct cache_header expected;
+    struct cache_header header;
+    header_init(&expected, source, st);
+
+    struct stat cache_st;
+    if (fstat(fileno(file), &cache_st)
+        || fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(&header, &expected, sizeof(header)) != 0) {
+        fclose(file);
+        return false;
+    }
+
+    size_t len  = cache_st.st_size - sizeof(header);
+    char *data  = malloc(len);
+    bool loaded = false;
+
+    size_t prefix = header.path_len + header.version_len;
+    if (data && len > prefix && fread(data, len, 1, file) == 1
+        && memcmp(data, source, header.path_len) == 0
+        && memcmp(data + header.path_len, CACHE_VERSION, header.version_len)
+               == 0) {
+        lua_pushfstring(L, "@%s", filename);
+        if (luaL_loadbuffer(
+                L, data + prefix, len - prefix, lua_tostring(L, -1))) {
+            lua_pop(L, 2);
+        } else {
+            lua_remove(L, -2);
+            loaded = true;
+        }
+    }
+
+    free(data);
+    fclose(file);
+
+    return loaded;
+}
+
+static int
+dump_writer(lua_State *UNUSED(L), const void *p, size_t size, void *ud)
+{
+    struct dump_buffer *buffer = ud;
+
+    if (buffer->len + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->len + size) {
+            capacity *= 2;
+        }
+
+        char *data = realloc(buffer->data, capacity);
+        if (!data) {
+            return 1;
+        }
+
+        buffer->data     = data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->len, p, size);
+    buffer->len += size;
+
+    return 0;
+}
+
+/**
+ * Dumps the function on top of the stack. The file is written next to its
+ * final name and renamed, so a concurrent reader never sees half of it.
+ */
+static void
+cache_store(
+    lua_State *L,
+    const char *source,
+    const char *path,
+    const struct stat *st)
+{
+    struct dump_buffer buffer = {0};
+    if (luaC_dump(L, dump_writer, &buffer) != 0) {
+        free(buffer.data);
+        return;
+    }
+
+    struct cache_header header;
+    header_init(&header, source, st);
+
+    char tmp[PATH_MAX];
+    int len = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (len < 0 || (size_t)len >= sizeof(tmp)) {
+        free(buffer.data);
+        return;
+    }
+
+    cache_mkdir(path);
+
+    FILE *file = fopen(tmp, "wb");
+    bool ok    = file && fwrite(&header, sizeof(header), 1, file) == 1
+              && fwrite(source, header.path_len, 1, file) == 1
+              && fwrite(CACHE_VERSION, header.version_len, 1, file) == 1
+              && fwrite(buffer.data, buffer.len, 1, file) == 1;
+    if (file && fclose(file)) {
+        ok = false;
+    }
+
+    if (!ok || rename(tmp, path)) {
+        wlr_log(WLR_DEBUG, "Failed to write bytecode cache %s", path);
+        unlink(tmp);
+    }
+
+    free(buffer.data);
+}
+
+/**
+ * Works like luaL_loadfile(), but reuses the bytecode of an earlier load
+ * while the file's mtime and size are unchanged.
+ */
+int
+luaK_bytecode_cache_loadfile(lua_State *L, const char *filename)
+{
+    char source[PATH_MAX];
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!realpath(filename, source) || stat(source, &st)
+        || !S_ISREG(st.st_mode) || !cache_path(source, path, sizeof(path))) {
+        return luaL_loadfile(L, filename);
+    }
+
+    if (cache_load(L, filename, source, path, &st)) {
+        return 0;
+    }
+
+    int error = luaL_loadfile(L, filename);
+    if (error) {
+        return error;
+    }
+
+    // don't pair the bytecode with a newer mtime than it was compiled from
+    struct stat after;
+    if (stat(source, &after) == 0 && stat_equal(&st, &after)) {
+        cache_store(L, source, path, &st);
+    }
+
+    return 0;
+}
+
+/**
+ * Pushes the first readable file matching 'name' in 'path', as the standard
+ * searcher resolves it.
+ */
+static const char *
+search_path(lua_State *L, const char *name, const char *path)
+{
+    const char *modname = luaL_gsub(L, name, ".", "/");
+
+    while (*path) {
+        size_t len = strcspn(path, ";");
+        if (len) {
+            lua_pushlstring(L, path, len);
+            const char *filename =
+                luaL_gsub(L, lua_tostring(L, -1), "?", modname);
+            lua_remove(L, -2);
+
+            if (access(filename, R_OK) == 0) {
+                return filename;
+            }
+            lua_pop(L, 1);
+        }
+
+        path += len;
+        if (*path) {
+            ++path;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Leaves modules it can't find to the standard searcher, which explains
+ * where it looked.
+ */
+static int
+bytecode_cache_searcher(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "path");
+    const char *path = lua_tostring(L, -1);
+    if (!path) {
+        return 0;
+    }
+
+    const char *filename = search_path(L, name, path);
+    if (!filename) {
+        return 0;
+    }
+
+    if (luaK_bytecode_cache_loadfile(L, filename)) {
+        return luaL_error(
+            L,
+            "error loading module '%s' from file '%s':\n\t%s",
+            name,
+            filename,
+            lua_tostring(L, -1));
+    }
+
+    lua_pushstring(L, filename);
+
+    return 2;
+}
+
+/**
+ * Puts the caching searcher in front of the standard Lua file searcher.
+ */
+void
+luaK_bytecode_cache_install(lua_State *L)
+{
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, LUAC_SEARCHERS);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return;
+    }
+
+    // after the preload searcher
+    int len = luaC_rawlen(L, -1);
+    for (int i = len; i >= 2; --i) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_pushcfunction(L, bytecode_cache_searcher);
+    lua_rawseti(L, -2, 2);
+
+    lua_pop(L, 2);
+}
@@ -0,0 +1,225 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "luak/gc.h"
+
+#include <wayland-server.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/util/log.h>
+
+#include "desktop/output.h"
+#include "server.h"
+
+#define GC_PAUSE           200       // percent of growth to start a cycle at
+#define GC_MIN_ESTIMATE    256       // KiB, don't bother with tiny heaps
+#define GC_DEFAULT_PERIOD  16666667  // ns, for outputs without a refresh rate
+#define GC_FALLBACK_PERIOD 250000000 // ns without frames to step anyway
+#define GC_FALLBACK_SLICE  1000000   // ns
+
+struct gc_slice {
+    struct kiwmi_lua_gc *gc;
+    uint64_t deadline;
+};
+
+static bool
+gc_has_debt(struct kiwmi_lua_gc *gc)
+{
+    if (gc->cycle_running) {
+        return true;
+    }
+
+    int estimate = gc->estimate;
+    if (estimate < GC_MIN_ESTIMATE) {
+        estimate = GC_MIN_ESTIMATE;
+    }
+
+    return lua_gc(gc->L, LUA_GCCOUNT, 0) >= estimate / 100 * GC_PAUSE;
+}
+
+/**
+ * Runs in protected mode, as finalizers may raise errors.
+ */
+static int
+gc_slice(lua_State *L)
+{
+    struct gc_slice *slice  = lua_touserdata(L, 1);
+    struct kiwmi_lua_gc *gc = slice->gc;
+
+    gc->cycle_running = true;
+
+    // at least one step, so the debt can't pile up under a busy renderer
+    do {
+        if (lua_gc(L, LUA_GCSTEP, 0)) {
+            gc->cycle_running = false;
+            gc->estimate      = lua_gc(L, LUA_GCCOUNT, 0);
+            break;
+        }
+    } while (timer_now() < slice->deadline);
+
+    return 0;
+}
+
+static void
+gc_run(struct kiwmi_lua_gc *gc, uint64_t deadline)
+{
+    lua_State *L = gc->L;
+
+    if (!gc_has_debt(gc)) {
+        return;
+    }
+
+    struct gc_slice slice = {
+        .gc       = gc,
+        .deadline = deadline,
+    };
+
+    lua_pushcfunction(L, gc_slice);
+    lua_pushlightuserdata(L, &slice);
+    if (lua_pcall(L, 1, 0, 0)) {
+        wlr_log(WLR_ERROR, "Error in finalizer: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    // stepping restarts the automatic collector on Lua 5.1 and LuaJIT
+    lua_gc(L, LUA_GCSTOP, 0);
+}
+
+static void
+gc_idle_handler(void *data)
+{
+    struct kiwmi_lua_gc *gc = data;
+
+    gc->idle = NULL;
+
+    gc_run(gc, gc->deadline);
+}
+
+/**
+ * Schedules a slice for after the frame, which ends a quarter of a refresh
+ * period before the next one is due.
+ */
+static void
+gc_output_frame_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_lua_gc *gc = wl_container_of(listener, gc, output_frame);
+    struct kiwmi_output_frame_event *event = data;
+    struct wlr_output *wlr_output          = event->output->wlr_output;
+
+    if (!gc->enabled) {
+        return;
+    }
+
+    uint64_t period = GC_DEFAULT_PERIOD;
+    if (wlr_output->refresh > 0) {
+        // refresh is in mHz
+        period = 1000000000000ull / wlr_output->refresh;
+    }
+
+    uint64_t start =
+        event->when->tv_sec * 1000000000ull + event->when->tv_nsec;
+    uint64_t deadline = start + period / 4 * 3;
+
+    gc->last_frame = timer_now();
+
+    // with multiple outputs, the earliest frame wins
+    if (gc->idle) {
+        if (deadline < gc->deadline) {
+            gc->deadline = deadline;
+        }
+        return;
+    }
+
+    gc->deadline = deadline;
+    gc->idle     = wl_event_loop_add_idle(
+        gc->server->wl_event_loop, gc_idle_handler, gc);
+}
+
+/**
+ * Keeps collecting while nothing is being rendered.
+ */
+static void
+gc_fallback_handler(struct kiwmi_timer *UNUSED(timer), void *data)
+{
+    struct kiwmi_lua_gc *gc = data;
+
+    if (gc->idle) {
+        return;
+    }
+
+    uint64_t now = timer_now();
+    if (now - gc->last_frame < GC_FALLBACK_PERIOD) {
+        return;
+    }
+
+    gc_run(gc, now + GC_FALLBACK_SLICE);
+}
+
+void
+luaK_gc_init(
+    struct kiwmi_lua_gc *gc,
+    lua_State *L,
+    struct kiwmi_server *server)
+{
+    gc->L             = L;
+    gc->server        = server;
+    gc->enabled       = false;
+    gc->cycle_running = false;
+    gc->estimate      = lua_gc(L, LUA_GCCOUNT, 0);
+    gc->deadline      = 0;
+    gc->last_frame    = 0;
+    gc->idle          = NULL;
+
+    timer_init(&gc->fallback, &server->timers, gc_fallback_handler, gc);
+
+    gc->output_frame.notify = gc_output_frame_notify;
+    wl_signal_add(&server->desktop.events.output_frame, &gc->output_frame);
+
+    luaK_gc_set_enabled(gc, true);
+}
+
+/**
+ * Can be called multiple times, the Lua state is left alone.
+ */
+void
+luaK_gc_fini(struct kiwmi_lua_gc *gc)
+{
+    timer_disarm(&gc->fallback);
+
+    if (gc->idle) {
+        wl_event_source_remove(gc->idle);
+        gc->idle = NULL;
+    }
+
+    wl_list_remove(&gc->output_frame.link);
+    wl_list_init(&gc->output_frame.link);
+}
+
+/**
+ * Switches between collecting between frames and Lua's own collector, which
+ * runs whenever enough has been allocated, e.g. in the middle of a frame.
+ */
+void
+luaK_gc_set_enabled(struct kiwmi_lua_gc *gc, bool enabled)
+{
+    if (gc->enabled == enabled) {
+        return;
+    }
+
+    gc->enabled = enabled;
+
+    if (enabled) {
+        lua_gc(gc->L, LUA_GCSTOP, 0);
+        timer_arm(&gc->fallback, GC_FALLBACK_PERIOD, GC_FALLBACK_PERIOD);
+    } else {
+        timer_disarm(&gc->fallback);
+        if (gc->idle) {
+            wl_event_source_remove(gc->idle);
+            gc->idle = NULL;
+        }
+        lua_gc(gc->L, LUA_GCRESTART, 0);
+    }
+}
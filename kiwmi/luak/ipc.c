@@ -7,22 +7,76 @@
 
 #include "luak/ipc.h"
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <lauxlib.h>
+#include <wlr/types/wlr_output.h>
 #include <wlr/util/log.h>
 
+#include "desktop/output.h"
+#include "desktop/view.h"
 #include "kiwmi-ipc-protocol.h"
+#include "luak/json.h"
 #include "luak/luak.h"
 
-static void
-ipc_eval(
-    struct wl_client *client,
-    struct wl_resource *resource,
-    uint32_t id,
-    const char *message)
+#define IPC_MAX_MESSAGE         4000 // bytes of a result in a done event
+#define IPC_QUEUE_SINCE_VERSION 6    // older clients have theirs run right away
+
+static int
+ipc_format_text(lua_State *L)
+{
+    int n = lua_gettop(L);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+
+    for (int i = 1; i <= n; ++i) {
+        if (i > 1) {
+            luaL_addlstring(&b, "\t", 1);
+        }
+
+        lua_getglobal(L, "tostring");
+        lua_pushvalue(L, i);
+        lua_call(L, 1, 1);
+        luaL_addvalue(&b);
+    }
+
+    luaL_pushresult(&b);
+
+    return 1;
+}
+
+/**
+ * Replaces the top 'n' values with their encoding, or an error message.
+ */
+static int
+ipc_encode(lua_State *L, int n, uint32_t format)
+{
+    switch (format) {
+    case KIWMI_IPC_FORMAT_TEXT:
+        lua_pushcfunction(L, ipc_format_text);
+        lua_insert(L, -(n + 1));
+        return lua_pcall(L, n, 1, 0);
+    case KIWMI_IPC_FORMAT_JSON:
+        return luaK_json_encode(L, n);
+    default:
+        lua_pop(L, n);
+        lua_pushfstring(L, "unknown format %d", (int)format);
+        return LUA_ERRRUN;
+    }
+}
+
+/**
+ * Leaves the encoded results or an error message on top of the stack.
+ */
+static int
+ipc_evaluate(struct kiwmi_server *server, const char *message, uint32_t format)
 {
-    struct kiwmi_server *server = wl_resource_get_user_data(resource);
-    struct wl_resource *command_resource =
-        wl_resource_create(client, &kiwmi_command_interface, 1, id);
     lua_State *L = server->lua->L;
 
     int top = lua_gettop(L);
@@ -30,49 +84,697 @@ ipc_eval(
     lua_pushboolean(L, true);
     lua_setglobal(L, "FROM_KIWMIC");
 
-    if (luaL_dostring(L, message)) {
-        const char *error = lua_tostring(L, -1);
-        wlr_log(WLR_ERROR, "Error running IPC command: %s", error);
-        kiwmi_command_send_done(
-            command_resource, KIWMI_COMMAND_ERROR_FAILURE, error);
-        lua_pop(L, 1);
+    int error = luaK_ipc_cache_load(&server->lua->ipc_cache, L, message)
+             || luaK_pcall(server->lua, 0, LUA_MULTRET, "ipc");
+
+    lua_pushboolean(L, false);
+    lua_setglobal(L, "FROM_KIWMIC");
 
-        lua_pushboolean(L, false);
-        lua_setglobal(L, "FROM_KIWMIC");
+    if (!error) {
+        error = ipc_encode(L, lua_gettop(L) - top, format);
+    }
+
+    if (error) {
+        if (!lua_isstring(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushliteral(L, "(error object is not a string)");
+        }
 
+        wlr_log(
+            WLR_ERROR, "Error running IPC command: %s", lua_tostring(L, -1));
+    }
+
+    return error;
+}
+
+static void
+ipc_result_destroy(struct kiwmi_ipc_result *result)
+{
+    if (result->event_source) {
+        wl_event_source_remove(result->event_source);
+    }
+
+    wl_list_remove(&result->link);
+    close(result->fd);
+    free(result->data);
+    free(result);
+}
+
+static int
+ipc_result_writable(int fd, uint32_t UNUSED(mask), void *data)
+{
+    struct kiwmi_ipc_result *result = data;
+
+    while (result->written < result->len) {
+        ssize_t n = write(
+            fd, result->data + result->written, result->len - result->written);
+        if (n >= 0) {
+            result->written += n;
+        } else if (errno == EAGAIN) {
+            return 0;
+        } else if (errno != EINTR) {
+            // most likely the client went away, nothing to tell it
+            break;
+        }
+    }
+
+    ipc_result_destroy(result);
+
+    return 0;
+}
+
+/**
+ * Writes the string on top of the stack to 'fd' in the background, or right
+ * away if it is a regular file, which can't be polled but never blocks.
+ * Closes 'fd' when done.
+ */
+static void
+ipc_result_start(struct kiwmi_server *server, int fd)
+{
+    lua_State *L = server->lua->L;
+
+    struct kiwmi_ipc_result *result = malloc(sizeof(*result));
+    if (!result) {
+        wlr_log(WLR_ERROR, "Failed to allocate kiwmi_ipc_result");
+        close(fd);
         return;
     }
 
-    lua_pushboolean(L, false);
-    lua_setglobal(L, "FROM_KIWMIC");
+    size_t len;
+    const char *str = lua_tolstring(L, -1, &len);
 
-    int results = top - lua_gettop(L);
+    result->fd           = fd;
+    result->event_source = NULL;
+    result->data         = malloc(len ? len : 1);
+    result->len          = len;
+    result->written      = 0;
+    wl_list_insert(&server->ipc->results, &result->link);
 
-    if (results == 0) {
-        kiwmi_command_send_done(
-            command_resource, KIWMI_COMMAND_ERROR_SUCCESS, "");
+    if (!result->data) {
+        wlr_log(WLR_ERROR, "Failed to allocate IPC result");
+        ipc_result_destroy(result);
+        return;
+    }
+
+    memcpy(result->data, str, len);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    result->event_source = wl_event_loop_add_fd(
+        server->wl_event_loop,
+        fd,
+        WL_EVENT_WRITABLE,
+        ipc_result_writable,
+        result);
+
+    if (!result->event_source || result->len == 0) {
+        ipc_result_writable(fd, 0, result);
+    }
+}
+
+/**
+ * The client is destroyed before its resources, the jobs are left for them
+ * to free.
+ */
+static void
+ipc_client_destroy_notify(struct wl_listener *listener, void *UNUSED(data))
+{
+    struct kiwmi_ipc_client *client =
+        wl_container_of(listener, client, destroy);
+
+    struct kiwmi_ipc_job *job;
+    struct kiwmi_ipc_job *tmp;
+    wl_list_for_each_safe (job, tmp, &client->jobs, link) {
+        wl_list_remove(&job->link);
+        wl_list_init(&job->link);
+        job->client = NULL;
+    }
+
+    wl_list_remove(&client->link);
+    wl_list_remove(&client->destroy.link);
+    free(client);
+}
+
+static struct kiwmi_ipc_client *
+ipc_client_get(struct kiwmi_ipc *ipc, struct wl_client *wl_client)
+{
+    struct wl_listener *listener =
+        wl_client_get_destroy_listener(wl_client, ipc_client_destroy_notify);
+    if (listener) {
+        struct kiwmi_ipc_client *client;
+        return wl_container_of(listener, client, destroy);
+    }
+
+    struct kiwmi_ipc_client *client = malloc(sizeof(*client));
+    if (!client) {
+        return NULL;
+    }
+
+    client->ipc         = ipc;
+    client->queued      = 0;
+    client->tokens      = ipc->limits.burst;
+    client->last_refill = timer_now();
+    wl_list_init(&client->jobs);
+    wl_list_insert(ipc->clients.prev, &client->link);
+
+    client->destroy.notify = ipc_client_destroy_notify;
+    wl_client_add_destroy_listener(wl_client, &client->destroy);
+
+    return client;
+}
+
+/**
+ * Returns 0 if the client may run a command now, otherwise how long it has
+ * to wait for that in ns.
+ */
+static uint64_t
+ipc_client_take_token(struct kiwmi_ipc_client *client, uint64_t now)
+{
+    struct kiwmi_ipc_limits *limits = &client->ipc->limits;
+
+    if (!(limits->rate > 0)) {
+        return 0;
+    }
+
+    double tokens =
+        client->tokens + (now - client->last_refill) * limits->rate / 1e9;
+
+    client->tokens      = tokens < limits->burst ? tokens : limits->burst;
+    client->last_refill = now;
+
+    if (client->tokens >= 1.0) {
+        client->tokens -= 1.0;
+        return 0;
+    }
+
+    return (uint64_t)((1.0 - client->tokens) / limits->rate * 1e9) + 1;
+}
+
+static void
+ipc_job_detach(struct kiwmi_ipc_job *job)
+{
+    if (!job->client) {
+        return;
+    }
+
+    wl_list_remove(&job->link);
+    wl_list_init(&job->link);
+    --job->client->queued;
+    job->client = NULL;
+}
+
+static void
+ipc_job_resource_destroy(struct wl_resource *resource)
+{
+    struct kiwmi_ipc_job *job = wl_resource_get_user_data(resource);
+
+    ipc_job_detach(job);
+
+    if (job->event_source) {
+        wl_event_source_remove(job->event_source);
+    }
+
+    if (job->fd >= 0) {
+        close(job->fd);
+    }
+    if (job->result_fd >= 0) {
+        close(job->result_fd);
+    }
+
+    free(job->data);
+    free(job);
+}
+
+/**
+ * Errors of commands sent with eval_fd are written to the result fd as
+ * well, the message of the done event stays empty.
+ */
+static void
+ipc_job_run(struct kiwmi_ipc_job *job)
+{
+    struct kiwmi_server *server = job->ipc->server;
+    lua_State *L                = server->lua->L;
+
+    ipc_job_detach(job);
+    ++job->ipc->stats.executed;
+
+    int top = lua_gettop(L);
+
+    int error;
+    if (job->error) {
+        lua_pushfstring(L, "failed to read command: %s", strerror(job->error));
+        error = LUA_ERRRUN;
     } else {
-        lua_getglobal(L, "tostring");
-        lua_insert(L, -2);
+        error = ipc_evaluate(server, job->data, job->format);
+    }
 
-        if (lua_pcall(L, 1, 1, 0)) {
-            const char *error = lua_tostring(L, -1);
-            wlr_log(WLR_ERROR, "Error running IPC command: %s", error);
-            kiwmi_command_send_done(
-                command_resource, KIWMI_COMMAND_ERROR_FAILURE, error);
-            lua_pop(L, 1);
-            return;
+    const char *message = lua_tostring(L, -1);
+    if (job->result_fd >= 0) {
+        ipc_result_start(server, job->result_fd);
+        job->result_fd = -1;
+        message        = "";
+    } else if (message && strlen(message) > IPC_MAX_MESSAGE) {
+        // libwayland would disconnect the client instead of sending it
+        error   = LUA_ERRRUN;
+        message = "result too long for a Wayland message, use eval_fd";
+    }
+
+    kiwmi_command_send_done(
+        job->resource,
+        error ? KIWMI_COMMAND_ERROR_FAILURE : KIWMI_COMMAND_ERROR_SUCCESS,
+        message);
+    wl_resource_destroy(job->resource);
+
+    lua_settop(L, top);
+}
+
+/**
+ * Picks the next client in turn with a command that may run now and moves
+ * it to the back of the line. Sets 'wait' to the time in ns until one of the
+ * clients that are out of tokens may continue, or UINT64_MAX.
+ */
+static struct kiwmi_ipc_job *
+ipc_next_job(struct kiwmi_ipc *ipc, uint64_t *wait)
+{
+    uint64_t now = timer_now();
+
+    *wait = UINT64_MAX;
+
+    int count = wl_list_length(&ipc->clients);
+    for (int i = 0; i < count; ++i) {
+        struct kiwmi_ipc_client *client =
+            wl_container_of(ipc->clients.next, client, link);
+
+        wl_list_remove(&client->link);
+        wl_list_insert(ipc->clients.prev, &client->link);
+
+        if (wl_list_empty(&client->jobs)) {
+            continue;
+        }
+
+        // the ones behind it have to wait for its body to be read
+        struct kiwmi_ipc_job *job =
+            wl_container_of(client->jobs.next, job, link);
+        if (!job->ready) {
+            continue;
+        }
+
+        uint64_t delay = ipc_client_take_token(client, now);
+        if (delay) {
+            if (delay < *wait) {
+                *wait = delay;
+            }
+            continue;
+        }
+
+        return job;
+    }
+
+    return NULL;
+}
+
+/**
+ * Once the budget is used up, the rest waits until the event loop has
+ * dispatched whatever came in meanwhile.
+ */
+static void
+ipc_run_jobs(struct kiwmi_ipc *ipc)
+{
+    uint64_t start = timer_now();
+    uint64_t wait;
+
+    struct kiwmi_ipc_job *job;
+    while ((job = ipc_next_job(ipc, &wait))) {
+        ipc_job_run(job);
+
+        if (ipc->limits.budget && timer_now() - start >= ipc->limits.budget) {
+            wait = 0;
+            break;
         }
+    }
 
+    if (wait != UINT64_MAX) {
+        timer_arm(&ipc->timer, wait, 0);
+    }
+}
+
+static void
+ipc_idle(void *data)
+{
+    struct kiwmi_ipc *ipc = data;
+
+    ipc->idle = NULL;
+
+    ipc_run_jobs(ipc);
+}
+
+static void
+ipc_timer(struct kiwmi_timer *UNUSED(timer), void *data)
+{
+    ipc_run_jobs(data);
+}
+
+/**
+ * Runs the queued commands after the requests that are being dispatched,
+ * so all of them are queued by then.
+ */
+static void
+ipc_schedule(struct kiwmi_ipc *ipc)
+{
+    if (ipc->idle) {
+        return;
+    }
+
+    ipc->idle =
+        wl_event_loop_add_idle(ipc->server->wl_event_loop, ipc_idle, ipc);
+    if (!ipc->idle) {
+        timer_arm(&ipc->timer, 0, 0);
+    }
+}
+
+/**
+ * Clients bound before version 6 may wait for the done event with a
+ * wl_display.sync sent after the command, so theirs run right away instead
+ * of being queued. They still count against the rate limit, but are rejected
+ * instead of waiting for a token.
+ */
+static void
+ipc_job_ready(struct kiwmi_ipc_job *job)
+{
+    struct kiwmi_ipc *ipc = job->ipc;
+
+    job->ready = true;
+
+    if (wl_resource_get_version(job->resource) >= IPC_QUEUE_SINCE_VERSION) {
+        ipc_schedule(ipc);
+        return;
+    }
+
+    if (ipc_client_take_token(job->client, timer_now())) {
+        ++ipc->stats.rejected;
         kiwmi_command_send_done(
-            command_resource, KIWMI_COMMAND_ERROR_SUCCESS, lua_tostring(L, -1));
+            job->resource, KIWMI_COMMAND_ERROR_FAILURE, "rate limited");
+        wl_resource_destroy(job->resource);
+        return;
+    }
+
+    ipc_job_run(job);
+}
+
+/**
+ * Queues a command for the client, unless too many are waiting already.
+ * Returns NULL if it has been dealt with.
+ */
+static struct kiwmi_ipc_job *
+ipc_job_create(
+    struct wl_client *client,
+    struct wl_resource *resource,
+    uint32_t id,
+    uint32_t format)
+{
+    struct kiwmi_server *server = wl_resource_get_user_data(resource);
+    struct kiwmi_ipc *ipc       = server->ipc;
+    int version                 = wl_resource_get_version(resource);
+
+    struct wl_resource *command_resource =
+        wl_resource_create(client, &kiwmi_command_interface, version, id);
+    if (!command_resource) {
+        wl_client_post_no_memory(client);
+        return NULL;
+    }
+
+    struct kiwmi_ipc_client *ipc_client = ipc_client_get(ipc, client);
+    struct kiwmi_ipc_job *job           = calloc(1, sizeof(*job));
+    if (!ipc_client || !job) {
+        free(job);
+        wl_resource_destroy(command_resource);
+        wl_client_post_no_memory(client);
+        return NULL;
+    }
+
+    if (ipc_client->queued >= ipc->limits.queue) {
+        ++ipc->stats.rejected;
+        free(job);
+        kiwmi_command_send_done(
+            command_resource,
+            KIWMI_COMMAND_ERROR_FAILURE,
+            "too many commands queued");
+        wl_resource_destroy(command_resource);
+        return NULL;
+    }
+
+    job->ipc       = ipc;
+    job->resource  = command_resource;
+    job->fd        = -1;
+    job->result_fd = -1;
+    job->format    = format;
+
+    wl_resource_set_implementation(
+        command_resource, NULL, job, ipc_job_resource_destroy);
+
+    job->client = ipc_client;
+    wl_list_insert(ipc_client->jobs.prev, &job->link);
+    ++ipc_client->queued;
+    ++ipc->stats.queued;
+
+    return job;
+}
+
+static void
+ipc_run(
+    struct wl_client *client,
+    struct wl_resource *resource,
+    uint32_t id,
+    const char *message,
+    uint32_t format)
+{
+    struct kiwmi_ipc_job *job = ipc_job_create(client, resource, id, format);
+    if (!job) {
+        return;
+    }
+
+    job->data = strdup(message);
+    if (!job->data) {
+        job->error = ENOMEM;
+    }
+
+    ipc_job_ready(job);
+}
+
+static void
+ipc_eval(
+    struct wl_client *client,
+    struct wl_resource *resource,
+    uint32_t id,
+    const char *message)
+{
+    ipc_run(client, resource, id, message, KIWMI_IPC_FORMAT_TEXT);
+}
+
+static void
+ipc_eval_format(
+    struct wl_client *client,
+    struct wl_resource *resource,
+    uint32_t id,
+    const char *message,
+    uint32_t format)
+{
+    ipc_run(client, resource, id, message, format);
+}
+
+static void
+ipc_job_body_done(struct kiwmi_ipc_job *job, int error)
+{
+    if (job->event_source) {
+        wl_event_source_remove(job->event_source);
+        job->event_source = NULL;
+    }
+
+    close(job->fd);
+    job->fd = -1;
+
+    if (!error) {
+        job->data[job->len] = '\0';
+    }
+
+    job->error = error;
+    ipc_job_ready(job);
+}
+
+static int
+ipc_job_readable(int fd, uint32_t UNUSED(mask), void *data)
+{
+    struct kiwmi_ipc_job *job = data;
+
+    while (true) {
+        if (job->len + 1 >= job->capacity) {
+            if (job->capacity >= KIWMI_IPC_BODY_MAX) {
+                ipc_job_body_done(job, EMSGSIZE);
+                return 0;
+            }
+
+            size_t capacity = job->capacity ? job->capacity * 2 : 4096;
+            char *grown     = realloc(job->data, capacity);
+            if (!grown) {
+                ipc_job_body_done(job, ENOMEM);
+                return 0;
+            }
+
+            job->data     = grown;
+            job->capacity = capacity;
+        }
+
+        ssize_t n =
+            read(fd, job->data + job->len, job->capacity - job->len - 1);
+        if (n > 0) {
+            job->len += n;
+        } else if (n == 0) {
+            ipc_job_body_done(job, 0);
+            return 0;
+        } else if (errno == EAGAIN) {
+            return 0;
+        } else if (errno != EINTR) {
+            ipc_job_body_done(job, errno);
+            return 0;
+        }
+    }
+}
+
+static void
+ipc_eval_fd(
+    struct wl_client *client,
+    struct wl_resource *resource,
+    uint32_t id,
+    int32_t body_fd,
+    int32_t result_fd,
+    uint32_t format)
+{
+    struct kiwmi_ipc_job *job = ipc_job_create(client, resource, id, format);
+    if (!job) {
+        close(body_fd);
+        close(result_fd);
+        return;
     }
 
-    lua_pop(L, results);
+    job->fd        = body_fd;
+    job->result_fd = result_fd;
+
+    fcntl(body_fd, F_SETFL, fcntl(body_fd, F_GETFL) | O_NONBLOCK);
+
+    job->event_source = wl_event_loop_add_fd(
+        job->ipc->server->wl_event_loop,
+        body_fd,
+        WL_EVENT_READABLE,
+        ipc_job_readable,
+        job);
+
+    if (!job->event_source) {
+        ipc_job_readable(body_fd, 0, job);
+    }
+}
+
+static void
+ipc_subscription_resource_destroy(struct wl_resource *resource)
+{
+    struct kiwmi_ipc_subscription *subscription =
+        wl_resource_get_user_data(resource);
+
+    wl_list_remove(&subscription->link);
+    free(subscription);
+}
+
+static void
+ipc_subscription_destroy(
+    struct wl_client *UNUSED(client),
+    struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static const struct kiwmi_subscription_interface
+    kiwmi_subscription_implementation = {
+        .destroy = ipc_subscription_destroy,
+};
+
+static void
+ipc_subscribe(
+    struct wl_client *client,
+    struct wl_resource *resource,
+    uint32_t id,
+    uint32_t event_classes)
+{
+    struct kiwmi_server *server = wl_resource_get_user_data(resource);
+    int version                 = wl_resource_get_version(resource);
+
+    struct kiwmi_ipc_subscription *subscription = malloc(sizeof(*subscription));
+    if (!subscription) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    subscription->resource =
+        wl_resource_create(client, &kiwmi_subscription_interface, version, id);
+    if (!subscription->resource) {
+        free(subscription);
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    subscription->event_classes = event_classes;
+
+    wl_resource_set_implementation(
+        subscription->resource,
+        &kiwmi_subscription_implementation,
+        subscription,
+        ipc_subscription_resource_destroy);
+
+    wl_list_insert(&server->ipc->subscriptions, &subscription->link);
+}
+
+static void
+ipc_snapshot_destroy(
+    struct wl_client *UNUSED(client),
+    struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static const struct kiwmi_snapshot_interface kiwmi_snapshot_implementation = {
+    .destroy = ipc_snapshot_destroy,
+};
+
+static void
+ipc_get_snapshot(
+    struct wl_client *client,
+    struct wl_resource *resource,
+    uint32_t id)
+{
+    struct kiwmi_server *server = wl_resource_get_user_data(resource);
+    int version                 = wl_resource_get_version(resource);
+
+    struct wl_resource *snapshot_resource =
+        wl_resource_create(client, &kiwmi_snapshot_interface, version, id);
+    if (!snapshot_resource) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(
+        snapshot_resource, &kiwmi_snapshot_implementation, NULL, NULL);
+
+    struct kiwmi_snapshot *snapshot = &server->desktop.snapshot;
+    if (snapshot->data) {
+        kiwmi_snapshot_send_memfd(
+            snapshot_resource, snapshot->fd, sizeof(*snapshot->data));
+    }
 }
 
 static const struct kiwmi_ipc_interface kiwmi_ipc_implementation = {
-    .eval = ipc_eval,
+    .eval         = ipc_eval,
+    .eval_format  = ipc_eval_format,
+    .subscribe    = ipc_subscribe,
+    .eval_fd      = ipc_eval_fd,
+    .get_snapshot = ipc_get_snapshot,
 };
 
 static void
@@ -103,15 +805,374 @@ ipc_server_bind(
         kiwmi_server_resource_destroy);
 }
 
+static bool
+ipc_subscribed(struct kiwmi_ipc *ipc, uint32_t event_class)
+{
+    struct kiwmi_ipc_subscription *subscription;
+    wl_list_for_each (subscription, &ipc->subscriptions, link) {
+        if (subscription->event_classes & event_class) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Pops the value on top of the stack and sends it as the data of the event.
+ * Returns non-zero with an error message on the stack instead if it can't be
+ * encoded.
+ */
+static int
+ipc_broadcast(
+    struct kiwmi_ipc *ipc,
+    lua_State *L,
+    uint32_t event_class,
+    const char *name)
+{
+    int error = luaK_json_encode_value(L);
+    if (error) {
+        return error;
+    }
+
+    const char *data = lua_tostring(L, -1);
+
+    struct kiwmi_ipc_subscription *subscription;
+    wl_list_for_each (subscription, &ipc->subscriptions, link) {
+        if (subscription->event_classes & event_class) {
+            kiwmi_subscription_send_event(
+                subscription->resource, event_class, name, data);
+        }
+    }
+
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+/**
+ * The data is put together in Lua to share the encoder with the results of
+ * eval, which is also why nothing is done without subscribers.
+ */
+static void
+ipc_broadcast_object(
+    struct kiwmi_ipc *ipc,
+    uint32_t event_class,
+    const char *name,
+    struct kiwmi_view *view,
+    struct kiwmi_output *output)
+{
+    if (!ipc_subscribed(ipc, event_class)) {
+        return;
+    }
+
+    lua_State *L = ipc->server->lua->L;
+
+    if (view) {
+        lua_createtable(L, 0, 3);
+        lua_pushnumber(L, (lua_Number)(size_t)view);
+        lua_setfield(L, -2, "id");
+        lua_pushstring(L, view_get_app_id(view));
+        lua_setfield(L, -2, "app_id");
+        lua_pushstring(L, view_get_title(view));
+        lua_setfield(L, -2, "title");
+    } else if (output) {
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, output->wlr_output->name);
+        lua_setfield(L, -2, "name");
+    } else {
+        lua_pushnil(L);
+    }
+
+    if (ipc_broadcast(ipc, L, event_class, name)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+static void
+ipc_new_output_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_ipc *ipc = wl_container_of(listener, ipc, new_output);
+
+    ipc_broadcast_object(ipc, KIWMI_IPC_EVENT_CLASS_OUTPUT, "add", NULL, data);
+}
+
+static void
+ipc_output_destroy_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_ipc *ipc = wl_container_of(listener, ipc, output_destroy);
+
+    ipc_broadcast_object(
+        ipc, KIWMI_IPC_EVENT_CLASS_OUTPUT, "remove", NULL, data);
+}
+
+static void
+ipc_view_focus_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_ipc *ipc = wl_container_of(listener, ipc, view_focus);
+
+    ipc_broadcast_object(ipc, KIWMI_IPC_EVENT_CLASS_FOCUS, "focus", data, NULL);
+}
+
+static void
+ipc_view_map_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_ipc *ipc = wl_container_of(listener, ipc, view_map);
+
+    ipc_broadcast_object(ipc, KIWMI_IPC_EVENT_CLASS_VIEW, "map", data, NULL);
+}
+
+static void
+ipc_view_unmap_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_ipc *ipc = wl_container_of(listener, ipc, view_unmap);
+
+    ipc_broadcast_object(ipc, KIWMI_IPC_EVENT_CLASS_VIEW, "unmap", data, NULL);
+}
+
 bool
-luaK_ipc_init(struct kiwmi_server *server, struct kiwmi_lua *lua)
+luaK_ipc_init(struct kiwmi_server *server)
 {
-    lua->global = wl_global_create(
-        server->wl_display, &kiwmi_ipc_interface, 1, server, ipc_server_bind);
-    if (!lua->global) {
+    struct kiwmi_ipc *ipc = malloc(sizeof(*ipc));
+    if (!ipc) {
+        wlr_log(WLR_ERROR, "Failed to allocate kiwmi_ipc");
+        return false;
+    }
+
+    ipc->server = server;
+    ipc->global = wl_global_create(
+        server->wl_display, &kiwmi_ipc_interface, 6, server, ipc_server_bind);
+    if (!ipc->global) {
         wlr_log(WLR_ERROR, "Failed to create IPC global");
+        free(ipc);
         return false;
     }
 
+    wl_list_init(&ipc->clients);
+    wl_list_init(&ipc->subscriptions);
+    wl_list_init(&ipc->results);
+
+    ipc->limits.rate   = 0;
+    ipc->limits.burst  = 16;
+    ipc->limits.queue  = 256;
+    ipc->limits.budget = 2000000; // 2 ms
+
+    ipc->stats.queued   = 0;
+    ipc->stats.executed = 0;
+    ipc->stats.rejected = 0;
+
+    ipc->idle = NULL;
+    timer_init(&ipc->timer, &server->timers, ipc_timer, ipc);
+
+    struct kiwmi_desktop *desktop = &server->desktop;
+
+    ipc->new_output.notify = ipc_new_output_notify;
+    wl_signal_add(&desktop->events.new_output, &ipc->new_output);
+
+    ipc->output_destroy.notify = ipc_output_destroy_notify;
+    wl_signal_add(&desktop->events.output_destroy, &ipc->output_destroy);
+
+    ipc->view_focus.notify = ipc_view_focus_notify;
+    wl_signal_add(&desktop->events.view_focus, &ipc->view_focus);
+
+    ipc->view_map.notify = ipc_view_map_notify;
+    wl_signal_add(&desktop->events.view_map, &ipc->view_map);
+
+    ipc->view_unmap.notify = ipc_view_unmap_notify;
+    wl_signal_add(&desktop->events.view_unmap, &ipc->view_unmap);
+
+    server->ipc = ipc;
+
     return true;
 }
+
+/**
+ * Called once the clients are gone, which took their subscriptions and
+ * queued commands with them.
+ */
+void
+luaK_ipc_fini(struct kiwmi_server *server)
+{
+    struct kiwmi_ipc *ipc = server->ipc;
+
+    if (ipc->idle) {
+        wl_event_source_remove(ipc->idle);
+    }
+    timer_disarm(&ipc->timer);
+
+    struct kiwmi_ipc_result *result;
+    struct kiwmi_ipc_result *tmp;
+    wl_list_for_each_safe (result, tmp, &ipc->results, link) {
+        ipc_result_destroy(result);
+    }
+
+    wl_global_destroy(ipc->global);
+
+    wl_list_remove(&ipc->new_output.link);
+    wl_list_remove(&ipc->output_destroy.link);
+    wl_list_remove(&ipc->view_focus.link);
+    wl_list_remove(&ipc->view_map.link);
+    wl_list_remove(&ipc->view_unmap.link);
+
+    free(ipc);
+    server->ipc = NULL;
+}
+
+/**
+ * Sends a custom event with the value on top of the stack as its data,
+ * which is left on the stack. Returns non-zero with an error message pushed
+ * if it can't be encoded.
+ */
+int
+luaK_ipc_emit(struct kiwmi_ipc *ipc, lua_State *L, const char *name)
+{
+    if (!ipc_subscribed(ipc, KIWMI_IPC_EVENT_CLASS_CUSTOM)) {
+        return 0;
+    }
+
+    lua_pushvalue(L, -1);
+
+    return ipc_broadcast(ipc, L, KIWMI_IPC_EVENT_CLASS_CUSTOM, name);
+}
+
+void
+luaK_ipc_push_stats(struct kiwmi_ipc *ipc, lua_State *L)
+{
+    size_t pending = 0;
+
+    struct kiwmi_ipc_client *client;
+    wl_list_for_each (client, &ipc->clients, link) {
+        pending += client->queued;
+    }
+
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, ipc->stats.queued);
+    lua_setfield(L, -2, "queued");
+    lua_pushnumber(L, ipc->stats.executed);
+    lua_setfield(L, -2, "executed");
+    lua_pushnumber(L, ipc->stats.rejected);
+    lua_setfield(L, -2, "rejected");
+    lua_pushinteger(L, pending);
+    lua_setfield(L, -2, "pending");
+}
+
+void
+luaK_ipc_cache_init(struct kiwmi_ipc_cache *cache)
+{
+    for (size_t i = 0; i < KIWMI_IPC_CACHE_SIZE; ++i) {
+        cache->chunks[i].message = NULL;
+    }
+
+    cache->clock  = 0;
+    cache->hits   = 0;
+    cache->misses = 0;
+}
+
+/**
+ * Only frees the messages, the chunks go away with the Lua state.
+ */
+void
+luaK_ipc_cache_fini(struct kiwmi_ipc_cache *cache)
+{
+    for (size_t i = 0; i < KIWMI_IPC_CACHE_SIZE; ++i) {
+        free(cache->chunks[i].message);
+        cache->chunks[i].message = NULL;
+    }
+}
+
+static uint64_t
+message_hash(const char *message)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *c = message; *c; ++c) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+/**
+ * Works like luaL_loadstring(), but reuses the chunk compiled for an earlier
+ * identical message. The least recently used chunk makes room for new ones.
+ */
+int
+luaK_ipc_cache_load(
+    struct kiwmi_ipc_cache *cache,
+    lua_State *L,
+    const char *message)
+{
+    uint64_t hash = message_hash(message);
+
+    struct kiwmi_ipc_chunk *victim = &cache->chunks[0];
+    for (size_t i = 0; i < KIWMI_IPC_CACHE_SIZE; ++i) {
+        struct kiwmi_ipc_chunk *chunk = &cache->chunks[i];
+
+        if (!chunk->message) {
+            if (victim->message) {
+                victim = chunk;
+            }
+            continue;
+        }
+
+        if (chunk->hash == hash && strcmp(chunk->message, message) == 0) {
+            ++cache->hits;
+            chunk->last_used = ++cache->clock;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, chunk->ref);
+            return 0;
+        }
+
+        if (victim->message && chunk->last_used < victim->last_used) {
+            victim = chunk;
+        }
+    }
+
+    ++cache->misses;
+
+    int error = luaL_loadstring(L, message);
+    if (error) {
+        return error;
+    }
+
+    char *copy = strdup(message);
+    if (!copy) {
+        // still usable, just not cached
+        return 0;
+    }
+
+    if (victim->message) {
+        free(victim->message);
+        luaL_unref(L, LUA_REGISTRYINDEX, victim->ref);
+    }
+
+    lua_pushvalue(L, -1);
+    victim->ref       = luaL_ref(L, LUA_REGISTRYINDEX);
+    victim->hash      = hash;
+    victim->message   = copy;
+    victim->last_used = ++cache->clock;
+
+    return 0;
+}
+
+void
+luaK_ipc_cache_push_stats(struct kiwmi_ipc_cache *cache, lua_State *L)
+{
+    int entries = 0;
+    for (size_t i = 0; i < KIWMI_IPC_CACHE_SIZE; ++i) {
+        if (cache->chunks[i].message) {
+            ++entries;
+        }
+    }
+
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, cache->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, cache->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, entries);
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, KIWMI_IPC_CACHE_SIZE);
+    lua_setfield(L, -2, "capacity");
+}
@@ -0,0 +1,335 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "luak/json.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+
+#include "luak/lua_compat.h"
+
+#define JSON_MAX_DEPTH 32
+
+struct json_buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+static void
+json_append(
+    lua_State *L,
+    struct json_buffer *buffer,
+    const char *data,
+    size_t len)
+{
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        while (capacity < buffer->len + len) {
+            capacity *= 2;
+        }
+
+        char *grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            luaL_error(L, "out of memory");
+        }
+
+        buffer->data     = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+static void
+json_literal(lua_State *L, struct json_buffer *buffer, const char *literal)
+{
+    json_append(L, buffer, literal, strlen(literal));
+}
+
+static void
+json_string(
+    lua_State *L,
+    struct json_buffer *buffer,
+    const char *str,
+    size_t len)
+{
+    json_literal(L, buffer, "\"");
+
+    // copy runs of characters that don't need escaping in one go
+    size_t run = 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = str[i];
+
+        char escape[8];
+        switch (c) {
+        case '"':
+            strcpy(escape, "\\\"");
+            break;
+        case '\\':
+            strcpy(escape, "\\\\");
+            break;
+        case '\n':
+            strcpy(escape, "\\n");
+            break;
+        case '\r':
+            strcpy(escape, "\\r");
+            break;
+        case '\t':
+            strcpy(escape, "\\t");
+            break;
+        default:
+            if (c >= 0x20) {
+                continue;
+            }
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            break;
+        }
+
+        json_append(L, buffer, str + run, i - run);
+        json_literal(L, buffer, escape);
+        run = i + 1;
+    }
+
+    json_append(L, buffer, str + run, len - run);
+    json_literal(L, buffer, "\"");
+}
+
+static void
+json_number(lua_State *L, struct json_buffer *buffer, int index)
+{
+    char number[32];
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, index)) {
+        snprintf(
+            number, sizeof(number), "%lld", (long long)lua_tointeger(L, index));
+        json_literal(L, buffer, number);
+        return;
+    }
+#endif
+
+    lua_Number n = lua_tonumber(L, index);
+
+    if (isnan(n) || isinf(n)) {
+        // JSON has no representation for these
+        json_literal(L, buffer, "null");
+    } else if (
+        n >= -9007199254740992.0 && n <= 9007199254740992.0
+        && n == (lua_Number)(long long)n) {
+        snprintf(number, sizeof(number), "%lld", (long long)n);
+        json_literal(L, buffer, number);
+    } else {
+        snprintf(number, sizeof(number), "%.17g", n);
+        json_literal(L, buffer, number);
+    }
+}
+
+/**
+ * Functions, userdata and threads become what tostring() would make of them
+ * without a __tostring metamethod.
+ */
+static void
+json_opaque(lua_State *L, struct json_buffer *buffer, int index)
+{
+    char opaque[64];
+    int len = snprintf(
+        opaque,
+        sizeof(opaque),
+        "%s: %p",
+        luaL_typename(L, index),
+        lua_topointer(L, index));
+
+    json_string(L, buffer, opaque, len);
+}
+
+static void json_value(
+    lua_State *L,
+    struct json_buffer *buffer,
+    int index,
+    int depth);
+
+static void
+json_key(lua_State *L, struct json_buffer *buffer, int index)
+{
+    switch (lua_type(L, index)) {
+    case LUA_TSTRING: {
+        size_t len;
+        const char *key = lua_tolstring(L, index, &len);
+        json_string(L, buffer, key, len);
+        break;
+    }
+    case LUA_TNUMBER:
+        // lua_tostring() would confuse lua_next() by converting the key
+        json_literal(L, buffer, "\"");
+        json_number(L, buffer, index);
+        json_literal(L, buffer, "\"");
+        break;
+    case LUA_TBOOLEAN:
+        json_literal(
+            L, buffer, lua_toboolean(L, index) ? "\"true\"" : "\"false\"");
+        break;
+    default:
+        json_opaque(L, buffer, index);
+        break;
+    }
+}
+
+/**
+ * Sequences become arrays, everything else including empty tables becomes
+ * an object.
+ */
+static void
+json_table(lua_State *L, struct json_buffer *buffer, int index, int depth)
+{
+    if (depth >= JSON_MAX_DEPTH) {
+        luaL_error(L, "tables nested too deeply (cycle?)");
+    }
+
+    luaL_checkstack(L, 3, "tables nested too deeply");
+
+    size_t len   = luaC_rawlen(L, index);
+    size_t count = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        ++count;
+        lua_pop(L, 1);
+    }
+
+    if (len > 0 && count == len) {
+        json_literal(L, buffer, "[");
+        for (size_t i = 1; i <= len; ++i) {
+            if (i > 1) {
+                json_literal(L, buffer, ",");
+            }
+            lua_rawgeti(L, index, i);
+            json_value(L, buffer, lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+        }
+        json_literal(L, buffer, "]");
+        return;
+    }
+
+    json_literal(L, buffer, "{");
+
+    bool first = true;
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        if (!first) {
+            json_literal(L, buffer, ",");
+        }
+        first = false;
+
+        json_key(L, buffer, lua_gettop(L) - 1);
+        json_literal(L, buffer, ":");
+        json_value(L, buffer, lua_gettop(L), depth + 1);
+        lua_pop(L, 1);
+    }
+
+    json_literal(L, buffer, "}");
+}
+
+static void
+json_value(lua_State *L, struct json_buffer *buffer, int index, int depth)
+{
+    switch (lua_type(L, index)) {
+    case LUA_TNIL:
+        json_literal(L, buffer, "null");
+        break;
+    case LUA_TBOOLEAN:
+        json_literal(L, buffer, lua_toboolean(L, index) ? "true" : "false");
+        break;
+    case LUA_TNUMBER:
+        json_number(L, buffer, index);
+        break;
+    case LUA_TSTRING: {
+        size_t len;
+        const char *str = lua_tolstring(L, index, &len);
+        json_string(L, buffer, str, len);
+        break;
+    }
+    case LUA_TTABLE:
+        json_table(L, buffer, index, depth);
+        break;
+    default:
+        json_opaque(L, buffer, index);
+        break;
+    }
+}
+
+static int
+json_encode_values(lua_State *L)
+{
+    struct json_buffer *buffer = lua_touserdata(L, 1);
+    bool array                 = lua_toboolean(L, 2);
+    int top                    = lua_gettop(L);
+
+    if (!array) {
+        json_value(L, buffer, 3, 0);
+        return 0;
+    }
+
+    json_literal(L, buffer, "[");
+    for (int i = 3; i <= top; ++i) {
+        if (i > 3) {
+            json_literal(L, buffer, ",");
+        }
+        json_value(L, buffer, i, 0);
+    }
+    json_literal(L, buffer, "]");
+
+    return 0;
+}
+
+static int
+json_encode(lua_State *L, int n, bool array)
+{
+    // not a luaL_Buffer, which can't share the stack with lua_next()
+    struct json_buffer buffer = {0};
+
+    lua_pushcfunction(L, json_encode_values);
+    lua_insert(L, -(n + 1));
+    lua_pushlightuserdata(L, &buffer);
+    lua_insert(L, -(n + 1));
+    lua_pushboolean(L, array);
+    lua_insert(L, -(n + 1));
+
+    int error = lua_pcall(L, n + 2, 0, 0);
+    if (!error) {
+        lua_pushlstring(L, buffer.data, buffer.len);
+    }
+
+    free(buffer.data);
+
+    return error;
+}
+
+/**
+ * Replaces the top 'n' values with a JSON array holding them. Like
+ * lua_pcall(), an error message is pushed instead if that fails.
+ */
+int
+luaK_json_encode(lua_State *L, int n)
+{
+    return json_encode(L, n, true);
+}
+
+/**
+ * Replaces the value on top of the stack with its JSON encoding.
+ */
+int
+luaK_json_encode_value(lua_State *L)
+{
+    return json_encode(L, 1, false);
+}
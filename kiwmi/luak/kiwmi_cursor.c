@@ -122,7 +122,7 @@ kiwmi_cursor_on_button_down_or_up_notify(
 
     lua_pushinteger(L, event->wlr_event->button - BTN_LEFT + 1);
 
-    if (lua_pcall(L, 1, 1, 0)) {
+    if (luaK_pcall(server->lua, 1, 1, "cursor.button")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
         return;
@@ -156,7 +156,7 @@ kiwmi_cursor_on_motion_notify(struct wl_listener *listener, void *data)
     lua_pushnumber(L, event->newy);
     lua_setfield(L, -2, "newy");
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "cursor.motion")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -183,7 +183,7 @@ kiwmi_cursor_on_scroll_notify(struct wl_listener *listener, void *data)
     lua_pushnumber(L, event->length);
     lua_setfield(L, -2, "length");
 
-    if (lua_pcall(L, 1, 1, 0)) {
+    if (luaK_pcall(server->lua, 1, 1, "cursor.scroll")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -209,12 +209,12 @@ l_kiwmi_cursor_on_button_down(lua_State *L)
     lua_pushlightuserdata(L, &cursor->events.button_down);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -234,12 +234,12 @@ l_kiwmi_cursor_on_button_up(lua_State *L)
     lua_pushlightuserdata(L, &cursor->events.button_up);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -259,12 +259,12 @@ l_kiwmi_cursor_on_motion(lua_State *L)
     lua_pushlightuserdata(L, &cursor->events.motion);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -284,12 +284,12 @@ l_kiwmi_cursor_on_scroll(lua_State *L)
     lua_pushlightuserdata(L, &cursor->events.scroll);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static const luaL_Reg kiwmi_cursor_events[] = {
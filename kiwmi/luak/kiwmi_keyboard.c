@@ -140,7 +140,7 @@ kiwmi_keyboard_on_destroy_notify(struct wl_listener *listener, void *data)
         return;
     }
 
-    if (lua_pcall(L, 1, 1, 0)) {
+    if (luaK_pcall(server->lua, 1, 1, "keyboard.destroy")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
         return;
@@ -149,21 +149,21 @@ kiwmi_keyboard_on_destroy_notify(struct wl_listener *listener, void *data)
 
 static bool
 send_key_event(
-    struct kiwmi_lua_callback *lc,
+    struct kiwmi_server *server,
+    int callback,
     xkb_keysym_t sym,
     uint32_t keycode,
     struct kiwmi_keyboard *keyboard,
     bool raw)
 {
-    struct kiwmi_server *server = lc->server;
-    lua_State *L                = server->lua->L;
+    lua_State *L = server->lua->L;
 
     static char keysym_name[64];
     size_t namelen = xkb_keysym_get_name(sym, keysym_name, sizeof(keysym_name));
 
     namelen = namelen > sizeof(keysym_name) ? sizeof(keysym_name) : namelen;
 
-    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+    lua_pushvalue(L, callback);
 
     lua_newtable(L);
 
@@ -186,7 +186,7 @@ send_key_event(
     }
     lua_setfield(L, -2, "keyboard");
 
-    if (lua_pcall(L, 1, 1, 0)) {
+    if (luaK_pcall(server->lua, 1, 1, "keyboard.key")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
         return false;
@@ -203,6 +203,8 @@ kiwmi_keyboard_on_key_down_or_up_notify(
     void *data)
 {
     struct kiwmi_lua_callback *lc = wl_container_of(listener, lc, listener);
+    struct kiwmi_server *server            = lc->server;
+    lua_State *L                           = server->lua->L;
     struct kiwmi_keyboard_key_event *event = data;
     struct kiwmi_keyboard *keyboard        = event->keyboard;
 
@@ -214,20 +216,28 @@ kiwmi_keyboard_on_key_down_or_up_notify(
 
     uint32_t keycode = event->keycode;
 
+    // the callback might cancel itself, so lc can't be used past this point
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+    int callback = lua_gettop(L);
+
     bool handled = false;
 
     for (int i = 0; i < translated_syms_len; ++i) {
         xkb_keysym_t sym = translated_syms[i];
-        handled |= send_key_event(lc, sym, keycode, keyboard, false);
+        handled |=
+            send_key_event(server, callback, sym, keycode, keyboard, false);
     }
 
     if (!handled) {
         for (int i = 0; i < raw_syms_len; ++i) {
             xkb_keysym_t sym = raw_syms[i];
-            handled |= send_key_event(lc, sym, keycode, keyboard, true);
+            handled |=
+                send_key_event(server, callback, sym, keycode, keyboard, true);
         }
     }
 
+    lua_pop(L, 1);
+
     event->handled = handled;
 }
 
@@ -252,12 +262,12 @@ l_kiwmi_keyboard_on_destroy(lua_State *L)
     lua_pushlightuserdata(L, &obj->events.destroy);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -281,12 +291,12 @@ l_kiwmi_keyboard_on_key_down(lua_State *L)
     lua_pushlightuserdata(L, &keyboard->events.key_down);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -310,12 +320,12 @@ l_kiwmi_keyboard_on_key_up(lua_State *L)
     lua_pushlightuserdata(L, &keyboard->events.key_up);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static const luaL_Reg kiwmi_keyboard_events[] = {
@@ -11,6 +11,43 @@
 
 #include <lauxlib.h>
 #include <wayland-server.h>
+#include <wlr/util/log.h>
+
+#include "luak/lua_compat.h"
+#include "timer.h"
+
+static int
+l_kiwmi_lua_callback_cancel(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_lua_callback");
+
+    // cancelling twice is harmless
+    if (!obj->valid) {
+        return 0;
+    }
+
+    luaK_kiwmi_lua_callback_destroy(obj->object);
+
+    return 0;
+}
+
+static int
+l_kiwmi_lua_callback_active(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_lua_callback");
+
+    lua_pushboolean(L, obj->valid);
+
+    return 1;
+}
+
+static const luaL_Reg kiwmi_lua_callback_methods[] = {
+    {"active", l_kiwmi_lua_callback_active},
+    {"cancel", l_kiwmi_lua_callback_cancel},
+    {NULL, NULL},
+};
 
 int
 luaK_kiwmi_lua_callback_new(lua_State *L)
@@ -28,7 +65,11 @@ luaK_kiwmi_lua_callback_new(lua_State *L)
 
     struct kiwmi_server *server = lua_touserdata(L, 1);
 
-    lc->server = server;
+    lc->server       = server;
+    lc->event_source = NULL;
+    lc->timer        = NULL;
+
+    wl_signal_init(&lc->events.destroy);
 
     lua_pushvalue(L, 2);
     lc->callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -40,5 +81,77 @@ luaK_kiwmi_lua_callback_new(lua_State *L)
 
     wl_list_insert(&object->callbacks, &lc->link);
 
+    lua_pushcfunction(L, luaK_kiwmi_lua_callback_handle);
+    lua_pushlightuserdata(L, object->lua);
+    lua_pushlightuserdata(L, lc);
+    if (lua_pcall(L, 2, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Pushes a handle that can be used to cancel the callback from Lua.
+ */
+int
+luaK_kiwmi_lua_callback_handle(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA); // kiwmi_lua
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA); // kiwmi_lua_callback
+
+    struct kiwmi_lua *lua         = lua_touserdata(L, 1);
+    struct kiwmi_lua_callback *lc = lua_touserdata(L, 2);
+
+    struct kiwmi_object *obj =
+        luaK_get_kiwmi_object(lua, lc, &lc->events.destroy);
+
+    struct kiwmi_object **lc_ud = lua_newuserdata(L, sizeof(*lc_ud));
+    luaL_getmetatable(L, "kiwmi_lua_callback");
+    lua_setmetatable(L, -2);
+
+    *lc_ud = obj;
+
+    return 1;
+}
+
+int
+luaK_kiwmi_lua_callback_register(lua_State *L)
+{
+    luaL_newmetatable(L, "kiwmi_lua_callback");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaC_setfuncs(L, kiwmi_lua_callback_methods, 0);
+
+    lua_pushcfunction(L, luaK_usertype_ref_equal);
+    lua_setfield(L, -2, "__eq");
+
+    lua_pushcfunction(L, luaK_kiwmi_object_gc);
+    lua_setfield(L, -2, "__gc");
+
     return 0;
 }
+
+void
+luaK_kiwmi_lua_callback_destroy(struct kiwmi_lua_callback *lc)
+{
+    wl_signal_emit(&lc->events.destroy, lc);
+
+    if (lc->event_source) {
+        wl_event_source_remove(lc->event_source);
+    }
+
+    if (lc->timer) {
+        timer_disarm(lc->timer);
+        free(lc->timer);
+    }
+
+    wl_list_remove(&lc->listener.link);
+    wl_list_remove(&lc->link);
+
+    luaL_unref(lc->server->lua->L, LUA_REGISTRYINDEX, lc->callback_ref);
+
+    free(lc);
+}
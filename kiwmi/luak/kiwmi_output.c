@@ -194,7 +194,7 @@ kiwmi_output_on_destroy_notify(struct wl_listener *listener, void *data)
         return;
     }
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "output.destroy")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -234,7 +234,7 @@ kiwmi_output_on_resize_notify(struct wl_listener *listener, void *data)
     lua_pushinteger(L, height);
     lua_setfield(L, -2, "height");
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "output.resize")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -278,7 +278,7 @@ kiwmi_output_on_usable_area_change_notify(
     lua_pushinteger(L, output->usable_area.height);
     lua_setfield(L, -2, "height");
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "output.usable_area_change")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -306,12 +306,12 @@ l_kiwmi_output_on_destroy(lua_State *L)
     lua_pushlightuserdata(L, &obj->events.destroy);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -336,12 +336,12 @@ l_kiwmi_output_on_resize(lua_State *L)
     lua_pushlightuserdata(L, &output->events.resize);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -366,12 +366,12 @@ l_kiwmi_output_on_usable_area_change(lua_State *L)
     lua_pushlightuserdata(L, &output->events.usable_area_change);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static const luaL_Reg kiwmi_output_events[] = {
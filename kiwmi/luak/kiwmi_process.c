@@ -0,0 +1,251 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "luak/kiwmi_process.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <lauxlib.h>
+#include <wayland-server.h>
+#include <wlr/util/log.h>
+
+#include "luak/kiwmi_lua_callback.h"
+#include "luak/lua_compat.h"
+#include "process.h"
+
+static int
+l_kiwmi_process_kill(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_process");
+    int signal_number = (int)luaL_optinteger(L, 2, SIGTERM);
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_process no longer valid");
+    }
+
+    struct kiwmi_process *process = obj->object;
+
+    // the pid might already belong to someone else
+    if (process->exited) {
+        return 0;
+    }
+
+    if (kill(process->pid, signal_number) < 0) {
+        return luaL_error(L, "Failed to kill process: %s", strerror(errno));
+    }
+
+    return 0;
+}
+
+static int
+l_kiwmi_process_pid(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_process");
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_process no longer valid");
+    }
+
+    struct kiwmi_process *process = obj->object;
+
+    lua_pushinteger(L, process->pid);
+
+    return 1;
+}
+
+static const luaL_Reg kiwmi_process_methods[] = {
+    {"kill", l_kiwmi_process_kill},
+    {"on", luaK_callback_register_dispatch},
+    {"pid", l_kiwmi_process_pid},
+    {NULL, NULL},
+};
+
+static void
+kiwmi_process_on_data_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_lua_callback *lc = wl_container_of(listener, lc, listener);
+    struct kiwmi_server *server            = lc->server;
+    lua_State *L                           = server->lua->L;
+    struct kiwmi_process_data_event *event = data;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+
+    lua_pushlstring(L, event->data, event->len);
+
+    if (luaK_pcall(server->lua, 1, 0, "process.output")) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+static void
+kiwmi_process_on_exit_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_lua_callback *lc = wl_container_of(listener, lc, listener);
+    struct kiwmi_server *server   = lc->server;
+    lua_State *L                  = server->lua->L;
+    struct kiwmi_process *process = data;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+
+    if (WIFEXITED(process->status)) {
+        lua_pushinteger(L, WEXITSTATUS(process->status));
+    } else {
+        lua_pushnil(L);
+    }
+
+    if (WIFSIGNALED(process->status)) {
+        lua_pushinteger(L, WTERMSIG(process->status));
+    } else {
+        lua_pushnil(L);
+    }
+
+    if (luaK_pcall(server->lua, 2, 0, "process.exit")) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+static int
+l_kiwmi_process_on_exit(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_process");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_process no longer valid");
+    }
+
+    struct kiwmi_process *process = obj->object;
+
+    lua_pushcfunction(L, luaK_kiwmi_lua_callback_new);
+    lua_pushlightuserdata(L, process->server);
+    lua_pushvalue(L, 2);
+    lua_pushlightuserdata(L, kiwmi_process_on_exit_notify);
+    lua_pushlightuserdata(L, &process->events.exit);
+    lua_pushlightuserdata(L, obj);
+
+    if (lua_pcall(L, 5, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+l_kiwmi_process_on_stderr(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_process");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_process no longer valid");
+    }
+
+    struct kiwmi_process *process = obj->object;
+
+    lua_pushcfunction(L, luaK_kiwmi_lua_callback_new);
+    lua_pushlightuserdata(L, process->server);
+    lua_pushvalue(L, 2);
+    lua_pushlightuserdata(L, kiwmi_process_on_data_notify);
+    lua_pushlightuserdata(L, &process->events.stderr_data);
+    lua_pushlightuserdata(L, obj);
+
+    if (lua_pcall(L, 5, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+l_kiwmi_process_on_stdout(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_process");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_process no longer valid");
+    }
+
+    struct kiwmi_process *process = obj->object;
+
+    lua_pushcfunction(L, luaK_kiwmi_lua_callback_new);
+    lua_pushlightuserdata(L, process->server);
+    lua_pushvalue(L, 2);
+    lua_pushlightuserdata(L, kiwmi_process_on_data_notify);
+    lua_pushlightuserdata(L, &process->events.stdout_data);
+    lua_pushlightuserdata(L, obj);
+
+    if (lua_pcall(L, 5, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
+}
+
+static const luaL_Reg kiwmi_process_events[] = {
+    {"exit", l_kiwmi_process_on_exit},
+    {"stderr", l_kiwmi_process_on_stderr},
+    {"stdout", l_kiwmi_process_on_stdout},
+    {NULL, NULL},
+};
+
+int
+luaK_kiwmi_process_new(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA); // kiwmi_lua
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA); // kiwmi_process
+
+    struct kiwmi_lua *lua         = lua_touserdata(L, 1);
+    struct kiwmi_process *process = lua_touserdata(L, 2);
+
+    struct kiwmi_object *obj =
+        luaK_get_kiwmi_object(lua, process, &process->events.destroy);
+
+    struct kiwmi_object **process_ud =
+        lua_newuserdata(L, sizeof(*process_ud));
+    luaL_getmetatable(L, "kiwmi_process");
+    lua_setmetatable(L, -2);
+
+    *process_ud = obj;
+
+    return 1;
+}
+
+int
+luaK_kiwmi_process_register(lua_State *L)
+{
+    luaL_newmetatable(L, "kiwmi_process");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaC_setfuncs(L, kiwmi_process_methods, 0);
+
+    luaC_newlib(L, kiwmi_process_events);
+    lua_setfield(L, -2, "__events");
+
+    lua_pushcfunction(L, luaK_usertype_ref_equal);
+    lua_setfield(L, -2, "__eq");
+
+    lua_pushcfunction(L, luaK_kiwmi_object_gc);
+    lua_setfield(L, -2, "__gc");
+
+    return 0;
+}
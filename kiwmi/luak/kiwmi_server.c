@@ -7,8 +7,13 @@
 
 #include "luak/kiwmi_server.h"
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <lauxlib.h>
@@ -18,105 +23,1067 @@
 #include <wlr/util/log.h>
 
 #include "color.h"
+#include "desktop/output.h"
 #include "desktop/view.h"
 #include "input/cursor.h"
 #include "input/input.h"
+#include "input/keyboard.h"
 #include "input/seat.h"
+#include "luak/allocator.h"
+#include "luak/gc.h"
+#include "luak/ipc.h"
 #include "luak/kiwmi_cursor.h"
 #include "luak/kiwmi_keyboard.h"
 #include "luak/kiwmi_lua_callback.h"
 #include "luak/kiwmi_output.h"
+#include "luak/kiwmi_process.h"
 #include "luak/kiwmi_view.h"
 #include "luak/lua_compat.h"
+#include "luak/profiler.h"
+#include "process.h"
 #include "server.h"
+#include "timer.h"
+
+/**
+ * Checks whether 'fd' is ready without waiting, setting errno to EAGAIN if it
+ * isn't. The fd itself is left alone, it may be shared with other processes.
+ */
+static bool
+fd_ready(int fd, short events)
+{
+    struct pollfd pfd = {
+        .fd     = fd,
+        .events = events,
+    };
+
+    int n;
+    do {
+        n = poll(&pfd, 1, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        return false;
+    }
+
+    if (n == 0) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    if (pfd.revents & POLLNVAL) {
+        errno = EBADF;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Only sockets can be written to without blocking per call, anything else is
+ * switched to non-blocking mode for the duration of the write.
+ */
+static ssize_t
+fd_write_nonblocking(int fd, const char *data, size_t size)
+{
+    ssize_t len = send(fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (len >= 0 || errno != ENOTSOCK) {
+        return len;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+
+    if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        return -1;
+    }
+
+    len = write(fd, data, size);
+
+    if (!(flags & O_NONBLOCK)) {
+        int error = errno;
+        fcntl(fd, F_SETFL, flags);
+        errno = error;
+    }
+
+    return len;
+}
+
+static uint32_t
+fd_mask_from_lua(lua_State *L, int arg, const char *def)
+{
+    const char *mode  = luaL_optstring(L, arg, def);
+    const char *error = "expected \"r\", \"w\" or \"rw\"";
+
+    uint32_t mask = 0;
+    for (const char *c = mode; *c; ++c) {
+        switch (*c) {
+        case 'r':
+            mask |= WL_EVENT_READABLE;
+            break;
+        case 'w':
+            mask |= WL_EVENT_WRITABLE;
+            break;
+        default:
+            return luaL_argerror(L, arg, error);
+        }
+    }
+
+    luaL_argcheck(L, mask, arg, error);
+
+    return mask;
+}
+
+static int
+push_errno(lua_State *L)
+{
+    int error = errno;
+
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(error));
+    lua_pushinteger(L, error);
+
+    return 3;
+}
+
+/**
+ * Converts a duration in (fractional) milliseconds to nanoseconds, durations
+ * too long to represent (e.g. math.huge) become the longest one.
+ */
+static uint64_t
+ms_to_ns(lua_Number ms)
+{
+    if (!(ms > 0)) {
+        return 0;
+    }
+
+    // UINT64_MAX itself rounds up to 2^64 as a double, which doesn't fit
+    double ns = ms * 1000000.0;
+    if (ns >= (double)UINT64_MAX) {
+        return UINT64_MAX;
+    }
+
+    return (uint64_t)ns;
+}
+
+/**
+ * Creates a callback owned by the Lua state, referencing the value on top of
+ * the stack, which is popped. Raises on failure.
+ */
+static struct kiwmi_lua_callback *
+scheduled_callback_new(lua_State *L, struct kiwmi_server *server)
+{
+    struct kiwmi_lua_callback *lc = malloc(sizeof(*lc));
+    if (!lc) {
+        luaL_error(L, "failed to allocate kiwmi_lua_callback");
+        return NULL;
+    }
+
+    lc->server       = server;
+    lc->callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lc->event_source = NULL;
+    lc->timer        = NULL;
+
+    wl_list_init(&lc->listener.link);
+    wl_signal_init(&lc->events.destroy);
+
+    wl_list_insert(&server->lua->scheduled_callbacks, &lc->link);
+
+    return lc;
+}
+
+static struct kiwmi_lua_callback *
+timer_callback_new(
+    lua_State *L,
+    struct kiwmi_server *server,
+    uint64_t delay,
+    uint64_t interval,
+    kiwmi_timer_func_t func)
+{
+    struct kiwmi_lua_callback *lc = scheduled_callback_new(L, server);
+
+    lc->timer = malloc(sizeof(*lc->timer));
+    if (!lc->timer) {
+        luaK_kiwmi_lua_callback_destroy(lc);
+        luaL_error(L, "failed to allocate kiwmi_timer");
+        return NULL;
+    }
+
+    timer_init(lc->timer, &server->timers, func, lc);
+
+    if (!timer_arm(lc->timer, delay, interval)) {
+        luaK_kiwmi_lua_callback_destroy(lc);
+        luaL_error(L, "failed to arm timer");
+        return NULL;
+    }
+
+    return lc;
+}
+
+static struct kiwmi_lua_callback *
+fd_callback_new(
+    lua_State *L,
+    struct kiwmi_server *server,
+    int fd,
+    uint32_t mask,
+    wl_event_loop_fd_func_t func)
+{
+    struct kiwmi_lua_callback *lc = scheduled_callback_new(L, server);
+
+    lc->event_source =
+        wl_event_loop_add_fd(server->wl_event_loop, fd, mask, func, lc);
+    if (!lc->event_source) {
+        luaK_kiwmi_lua_callback_destroy(lc);
+        luaL_error(L, "failed to watch fd");
+        return NULL;
+    }
+
+    return lc;
+}
+
+static int
+l_kiwmi_server_active_output(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_server *server = obj->object;
+
+    struct kiwmi_output *output = desktop_active_output(server);
+
+    lua_pushcfunction(L, luaK_kiwmi_output_new);
+    lua_pushlightuserdata(L, server->lua);
+    lua_pushlightuserdata(L, output);
+    if (lua_pcall(L, 2, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_async(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    int nargs = lua_gettop(L) - 2;
+
+    lua_State *co = lua_newthread(L);
+    lua_insert(L, 2);
+
+    // moves the function and its arguments
+    lua_xmove(L, co, nargs + 1);
+    luaK_resume(obj->lua, co, nargs);
+
+    lua_settop(L, 2);
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_bg_color(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TSTRING);
+
+    struct kiwmi_server *server = obj->object;
+
+    float color[4];
+    if (!color_parse(lua_tostring(L, 2), color)) {
+        return luaL_argerror(L, 2, "not a valid color");
+    }
+
+    server->desktop.bg_color[0] = color[0];
+    server->desktop.bg_color[1] = color[1];
+    server->desktop.bg_color[2] = color[2];
+    // ignore alpha
+
+    return 0;
+}
+
+static int
+l_kiwmi_server_cursor(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_server *server = obj->object;
+
+    lua_pushcfunction(L, luaK_kiwmi_cursor_new);
+    lua_pushlightuserdata(L, server->lua);
+    lua_pushlightuserdata(L, server->input.cursor);
+    if (lua_pcall(L, 2, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
+}
+
+static void
+kiwmi_server_defer_handler(void *data)
+{
+    struct kiwmi_lua *lua = data;
+
+    lua->deferred_idle = NULL;
+
+    luaK_run_deferred(lua);
+}
+
+static int
+l_kiwmi_server_defer(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TFUNCTION); // callback
+
+    struct kiwmi_server *server = obj->object;
+    struct kiwmi_lua *lua       = obj->lua;
+
+    // while they run, luaK_run_deferred() takes care of it
+    if (!lua->deferred_idle && !lua->deferring
+        && !timer_pending(&lua->deferred_timer)) {
+        lua->deferred_idle = wl_event_loop_add_idle(
+            server->wl_event_loop, kiwmi_server_defer_handler, lua);
+        if (!lua->deferred_idle) {
+            return luaL_error(L, "failed to add idle source");
+        }
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->deferred);
+    int deferred = lua_gettop(L);
+
+    lua_Integer index = luaC_rawlen(L, deferred) + 1;
+
+    if (!lua_isnoneornil(L, 3)) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lua->deferred_keys);
+        lua_pushvalue(L, 3);
+        lua_rawget(L, -2);
+
+        if (lua_isnumber(L, -1)) {
+            // already pending, the newest callback takes its place
+            index = lua_tointeger(L, -1);
+        } else {
+            lua_pushvalue(L, 3);
+            lua_pushinteger(L, index);
+            lua_rawset(L, -4);
+        }
+
+        lua_pop(L, 2);
+    }
+
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, deferred, index);
+
+    return 0;
+}
+
+static int
+l_kiwmi_server_emit(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    const char *name = luaL_checkstring(L, 2);
+
+    struct kiwmi_server *server = obj->object;
+
+    lua_settop(L, 3); // data, nil if missing
+
+    if (luaK_ipc_emit(server->ipc, L, name)) {
+        return lua_error(L);
+    }
+
+    return 0;
+}
+
+static int
+l_kiwmi_server_focused_view(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_server *server = obj->object;
+
+    if (!server->input.seat->focused_view) {
+        return 0;
+    }
+
+    lua_pushcfunction(L, luaK_kiwmi_view_new);
+    lua_pushlightuserdata(L, server->lua);
+    lua_pushlightuserdata(L, server->input.seat->focused_view);
+    if (lua_pcall(L, 2, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_frame_gc(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_lua_gc *gc = &obj->lua->gc;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TBOOLEAN);
+        luaK_gc_set_enabled(gc, lua_toboolean(L, 2));
+    }
+
+    lua_pushboolean(L, gc->enabled);
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_ipc_cache(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    luaK_ipc_cache_push_stats(&obj->lua->ipc_cache, L);
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_ipc_limits(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_server *server     = obj->object;
+    struct kiwmi_ipc_limits *limits = &server->ipc->limits;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "rate");
+        if (!lua_isnil(L, -1)) {
+            double rate = lua_tonumber(L, -1);
+            luaL_argcheck(
+                L, lua_isnumber(L, -1) && rate >= 0, 2, "invalid rate");
+            limits->rate = rate;
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "burst");
+        if (!lua_isnil(L, -1)) {
+            double burst = lua_tonumber(L, -1);
+            luaL_argcheck(
+                L, lua_isnumber(L, -1) && burst >= 1, 2, "invalid burst");
+            limits->burst = burst;
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "queue");
+        if (!lua_isnil(L, -1)) {
+            lua_Integer queue = lua_tointeger(L, -1);
+            luaL_argcheck(
+                L, lua_isnumber(L, -1) && queue >= 1, 2, "invalid queue");
+            limits->queue = queue;
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "budget");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_isnumber(L, -1), 2, "invalid budget");
+            limits->budget = ms_to_ns(lua_tonumber(L, -1));
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, limits->rate);
+    lua_setfield(L, -2, "rate");
+    lua_pushnumber(L, limits->burst);
+    lua_setfield(L, -2, "burst");
+    lua_pushinteger(L, limits->queue);
+    lua_setfield(L, -2, "queue");
+    lua_pushnumber(L, limits->budget / 1000000.0);
+    lua_setfield(L, -2, "budget");
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_ipc_stats(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_server *server = obj->object;
+
+    luaK_ipc_push_stats(server->ipc, L);
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_memory(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    luaK_allocator_push_stats(&obj->lua->allocator, L);
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_output_at(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TNUMBER); // lx
+    luaL_checktype(L, 3, LUA_TNUMBER); // ly
+
+    struct kiwmi_server *server = obj->object;
+
+    double lx = lua_tonumber(L, 2);
+    double ly = lua_tonumber(L, 3);
+
+    struct wlr_output *wlr_output =
+        wlr_output_layout_output_at(server->desktop.output_layout, lx, ly);
+
+    if (wlr_output) {
+        lua_pushcfunction(L, luaK_kiwmi_output_new);
+        lua_pushlightuserdata(L, obj->lua);
+        lua_pushlightuserdata(L, wlr_output->data);
+        if (lua_pcall(L, 2, 1, 0)) {
+            wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+            return 0;
+        }
+    } else {
+        lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_profile(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_profiler *profiler = &obj->lua->profiler;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TBOOLEAN);
+        profiler->enabled = lua_toboolean(L, 2);
+    }
+
+    lua_pushboolean(L, profiler->enabled);
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_profile_report(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    luaK_profiler_push_report(&obj->lua->profiler, L);
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_profile_reset(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    luaK_profiler_reset(&obj->lua->profiler);
+
+    return 0;
+}
+
+static int
+l_kiwmi_server_quit(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_server *server = obj->object;
+
+    wl_display_terminate(server->wl_display);
+
+    return 0;
+}
+
+static int
+l_kiwmi_server_read_fd(lua_State *L)
+{
+    luaL_checkudata(L, 1, "kiwmi_server");
+    int fd           = luaL_checkinteger(L, 2);
+    lua_Integer size = luaL_optinteger(L, 3, 4096);
+
+    luaL_argcheck(L, size > 0, 3, "size must be positive");
+
+    if (!fd_ready(fd, POLLIN)) {
+        return push_errno(L);
+    }
+
+    char *buf = lua_newuserdata(L, size);
+
+    ssize_t len = read(fd, buf, size);
+    if (len < 0) {
+        return push_errno(L);
+    }
+
+    lua_pushlstring(L, buf, len);
+
+    return 1;
+}
+
+static void
+kiwmi_server_reload_handler(void *data)
+{
+    struct kiwmi_lua *lua = data;
+
+    lua->reload_idle = NULL;
+
+    luaK_reload(lua);
+}
+
+/**
+ * The state running this can't be closed under its feet, so the reload
+ * happens once the compositor is idle.
+ */
+static int
+l_kiwmi_server_reload(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_server *server = obj->object;
+    struct kiwmi_lua *lua       = obj->lua;
+
+    if (!lua->reload_idle) {
+        lua->reload_idle = wl_event_loop_add_idle(
+            server->wl_event_loop, kiwmi_server_reload_handler, lua);
+        if (!lua->reload_idle) {
+            return luaL_error(L, "failed to add idle source");
+        }
+    }
+
+    return 0;
+}
+
+static void
+kiwmi_server_schedule_handler(struct kiwmi_timer *timer, void *data)
+{
+    struct kiwmi_lua_callback *lc = data;
+    struct kiwmi_lua *lua         = lc->server->lua;
+    lua_State *L                  = lua->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+    lua_pushvalue(L, -1);
+
+    // one-shot callbacks are done, even if they error or cancel themselves
+    if (!timer->interval) {
+        luaK_kiwmi_lua_callback_destroy(lc);
+    }
+
+    if (luaK_pcall(lua, 1, 0, "schedule")) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+static int
+l_kiwmi_server_schedule(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TNUMBER);   // delay
+    luaL_checktype(L, 3, LUA_TFUNCTION); // callback
+
+    struct kiwmi_server *server = obj->object;
+
+    uint64_t delay    = ms_to_ns(lua_tonumber(L, 2));
+    uint64_t interval = ms_to_ns(luaL_optnumber(L, 4, 0));
+
+    lua_pushvalue(L, 3);
+    struct kiwmi_lua_callback *lc = timer_callback_new(
+        L, server, delay, interval, kiwmi_server_schedule_handler);
+
+    lua_pushcfunction(L, luaK_kiwmi_lua_callback_handle);
+    lua_pushlightuserdata(L, obj->lua);
+    lua_pushlightuserdata(L, lc);
+    if (lua_pcall(L, 2, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_set_verbosity(lua_State *L)
+{
+    luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TNUMBER);
+
+    int verbosity = lua_tointeger(L, 2);
+
+    if (verbosity < WLR_SILENT) {
+        verbosity = WLR_SILENT;
+    } else if (verbosity >= WLR_LOG_IMPORTANCE_LAST) {
+        verbosity = WLR_DEBUG;
+    }
+
+    wlr_log_init((enum wlr_log_importance)verbosity, NULL);
+
+    return 0;
+}
+
+static void
+kiwmi_server_sleep_handler(struct kiwmi_timer *UNUSED(timer), void *data)
+{
+    struct kiwmi_lua_callback *lc = data;
+    struct kiwmi_lua *lua         = lc->server->lua;
+    lua_State *L                  = lua->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+    luaK_kiwmi_lua_callback_destroy(lc);
+
+    lua_State *co = lua_tothread(L, -1);
+    if (lua_status(co) == LUA_YIELD) {
+        luaK_resume(lua, co, 0);
+    }
+
+    lua_pop(L, 1);
+}
+
+static int
+l_kiwmi_server_sleep(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TNUMBER); // delay
+
+    struct kiwmi_server *server = obj->object;
+
+    uint64_t delay = ms_to_ns(lua_tonumber(L, 2));
+
+    if (lua_pushthread(L)) {
+        return luaL_error(L, "kiwmi:sleep() must be called from kiwmi:async()");
+    }
+
+    timer_callback_new(L, server, delay, 0, kiwmi_server_sleep_handler);
+
+    return lua_yield(L, 0);
+}
+
+/**
+ * Reads a command (a string for /bin/sh or an argv table) at index 'command'
+ * and an optional options table at index 'opts' into 'options'. Everything is
+ * kept alive on the Lua stack, so raising errors midway doesn't leak.
+ */
+static void
+spawn_options_from_lua(
+    lua_State *L,
+    int command,
+    int opts,
+    struct kiwmi_spawn_options *options)
+{
+    options->env       = NULL;
+    options->cwd       = NULL;
+    options->stdout_fd = -1;
+    options->stderr_fd = -1;
+
+    if (lua_type(L, command) == LUA_TSTRING) {
+        const char **argv = lua_newuserdata(L, 4 * sizeof(*argv));
+        argv[0]           = "/bin/sh";
+        argv[1]           = "-c";
+        argv[2]           = lua_tostring(L, command);
+        argv[3]           = NULL;
+
+        options->argv = (char *const *)argv;
+    } else {
+        luaL_checktype(L, command, LUA_TTABLE);
+
+        size_t len = luaC_rawlen(L, command);
+        luaL_argcheck(L, len > 0, command, "empty argv");
+
+        const char **argv = lua_newuserdata(L, (len + 1) * sizeof(*argv));
+        for (size_t i = 0; i < len; ++i) {
+            lua_rawgeti(L, command, i + 1);
+            luaL_argcheck(
+                L, lua_type(L, -1) == LUA_TSTRING, command, "expected strings");
+            argv[i] = lua_tostring(L, -1); // still referenced by the table
+            lua_pop(L, 1);
+        }
+        argv[len] = NULL;
+
+        options->argv = (char *const *)argv;
+    }
+
+    if (lua_isnoneornil(L, opts)) {
+        return;
+    }
+
+    luaL_checktype(L, opts, LUA_TTABLE);
+
+    lua_getfield(L, opts, "cwd");
+    if (!lua_isnil(L, -1)) {
+        luaL_argcheck(
+            L, lua_type(L, -1) == LUA_TSTRING, opts, "cwd must be a string");
+        options->cwd = lua_tostring(L, -1);
+    }
+
+    lua_getfield(L, opts, "env");
+    if (lua_isnil(L, -1)) {
+        return;
+    }
+
+    luaL_argcheck(L, lua_istable(L, -1), opts, "env must be a table");
+    int env_table = lua_gettop(L);
+
+    size_t len = 0;
+    lua_pushnil(L);
+    while (lua_next(L, env_table)) {
+        ++len;
+        lua_pop(L, 1);
+    }
+
+    const char **env = lua_newuserdata(L, (len + 1) * sizeof(*env));
+
+    // keeps the formatted strings alive
+    lua_newtable(L);
+    int anchor = lua_gettop(L);
+
+    size_t i = 0;
+    lua_pushnil(L);
+    while (lua_next(L, env_table)) {
+        luaL_argcheck(
+            L,
+            lua_type(L, -2) == LUA_TSTRING && !strchr(lua_tostring(L, -2), '='),
+            opts,
+            "invalid env name");
+
+        if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+            // a bare name unsets the variable
+            lua_pushvalue(L, -2);
+        } else {
+            luaL_argcheck(
+                L, lua_isstring(L, -1), opts, "env values must be strings");
+            lua_pushfstring(
+                L, "%s=%s", lua_tostring(L, -2), lua_tostring(L, -1));
+        }
+
+        env[i] = lua_tostring(L, -1);
+        lua_rawseti(L, anchor, ++i);
+        lua_pop(L, 1);
+    }
+    env[len] = NULL;
+
+    options->env = (char *const *)env;
+}
+
+static int
+l_kiwmi_server_spawn(lua_State *L)
+{
+    luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_spawn_options options;
+    spawn_options_from_lua(L, 2, 3, &options);
+
+    pid_t pid = process_spawn(&options);
+    if (pid < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Failed to run command: %s", strerror(errno));
+        return 2;
+    }
+
+    lua_pushinteger(L, pid);
+
+    return 1;
+}
+
+static const char *const spawn_async_handlers[][2] = {
+    {"on_exit", "exit"},
+    {"on_stderr", "stderr"},
+    {"on_stdout", "stdout"},
+};
 
 static int
-l_kiwmi_server_active_output(lua_State *L)
+l_kiwmi_server_spawn_async(lua_State *L)
 {
     struct kiwmi_object *obj =
         *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
 
     struct kiwmi_server *server = obj->object;
 
-    struct kiwmi_output *output = desktop_active_output(server);
+    struct kiwmi_spawn_options options;
+    spawn_options_from_lua(L, 2, 3, &options);
+
+    size_t handler_count =
+        sizeof(spawn_async_handlers) / sizeof(spawn_async_handlers[0]);
+
+    // check the handlers up front, the process can't be taken back later
+    bool has_opts = lua_istable(L, 3);
+    for (size_t i = 0; has_opts && i < handler_count; ++i) {
+        lua_getfield(L, 3, spawn_async_handlers[i][0]);
+        luaL_argcheck(
+            L,
+            lua_isnil(L, -1) || lua_isfunction(L, -1),
+            3,
+            "handlers must be functions");
+        lua_pop(L, 1);
+    }
 
-    lua_pushcfunction(L, luaK_kiwmi_output_new);
-    lua_pushlightuserdata(L, server->lua);
-    lua_pushlightuserdata(L, output);
+    struct kiwmi_process *process = process_spawn_async(server, &options);
+    if (!process) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Failed to run command: %s", strerror(errno));
+        return 2;
+    }
+
+    lua_pushcfunction(L, luaK_kiwmi_process_new);
+    lua_pushlightuserdata(L, obj->lua);
+    lua_pushlightuserdata(L, process);
     if (lua_pcall(L, 2, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
+    int process_ud = lua_gettop(L);
+
+    for (size_t i = 0; has_opts && i < handler_count; ++i) {
+        lua_getfield(L, 3, spawn_async_handlers[i][0]);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        lua_pushcfunction(L, luaK_callback_register_dispatch);
+        lua_pushvalue(L, process_ud);
+        lua_pushstring(L, spawn_async_handlers[i][1]);
+        lua_pushvalue(L, -4);
+
+        if (lua_pcall(L, 3, 0, 0)) {
+            wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    lua_pushvalue(L, process_ud);
+
     return 1;
 }
 
 static int
-l_kiwmi_server_bg_color(lua_State *L)
+l_kiwmi_server_stop_interactive(lua_State *L)
 {
     struct kiwmi_object *obj =
         *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
-    luaL_checktype(L, 2, LUA_TSTRING);
 
     struct kiwmi_server *server = obj->object;
 
-    float color[4];
-    if (!color_parse(lua_tostring(L, 2), color)) {
-        return luaL_argerror(L, 2, "not a valid color");
-    }
-
-    server->desktop.bg_color[0] = color[0];
-    server->desktop.bg_color[1] = color[1];
-    server->desktop.bg_color[2] = color[2];
-    // ignore alpha
+    server->input.cursor->cursor_mode = KIWMI_CURSOR_PASSTHROUGH;
 
     return 0;
 }
 
 static int
-l_kiwmi_server_cursor(lua_State *L)
+l_kiwmi_server_texture_memory(lua_State *L)
 {
     struct kiwmi_object *obj =
         *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
 
-    struct kiwmi_server *server = obj->object;
+    struct kiwmi_server *server     = obj->object;
+    struct kiwmi_textures *textures = &server->desktop.textures;
 
-    lua_pushcfunction(L, luaK_kiwmi_cursor_new);
-    lua_pushlightuserdata(L, server->lua);
-    lua_pushlightuserdata(L, server->input.cursor);
-    if (lua_pcall(L, 2, 1, 0)) {
-        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
-        return 0;
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, textures_size(textures, false));
+    lua_setfield(L, -2, "total");
+    lua_pushinteger(L, textures_size(textures, true));
+    lua_setfield(L, -2, "hidden");
+
+    return 1;
+}
+
+static int
+l_kiwmi_server_texture_policy(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    struct kiwmi_server *server     = obj->object;
+    struct kiwmi_textures *textures = &server->desktop.textures;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "hidden_timeout");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_isnumber(L, -1), 2, "invalid hidden_timeout");
+            textures->hidden_timeout = ms_to_ns(lua_tonumber(L, -1));
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "budget");
+        if (!lua_isnil(L, -1)) {
+            lua_Integer budget = lua_tointeger(L, -1);
+            luaL_argcheck(
+                L, lua_isnumber(L, -1) && budget >= 0, 2, "invalid budget");
+            textures->budget = budget;
+        }
+        lua_pop(L, 1);
+
+        textures_update(textures);
     }
 
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, textures->hidden_timeout / 1000000.0);
+    lua_setfield(L, -2, "hidden_timeout");
+    lua_pushinteger(L, textures->budget);
+    lua_setfield(L, -2, "budget");
+
     return 1;
 }
 
 static int
-l_kiwmi_server_focused_view(lua_State *L)
+l_kiwmi_server_unfocus(lua_State *L)
 {
     struct kiwmi_object *obj =
         *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
 
     struct kiwmi_server *server = obj->object;
 
-    if (!server->input.seat->focused_view) {
-        return 0;
-    }
+    seat_focus_view(server->input.seat, NULL);
 
-    lua_pushcfunction(L, luaK_kiwmi_view_new);
-    lua_pushlightuserdata(L, server->lua);
-    lua_pushlightuserdata(L, server->input.seat->focused_view);
-    if (lua_pcall(L, 2, 1, 0)) {
-        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
-        return 0;
-    }
+    return 0;
+}
+
+static int
+l_kiwmi_server_verbosity(lua_State *L)
+{
+    luaL_checkudata(L, 1, "kiwmi_server");
+
+    int verbosity = (int)wlr_log_get_verbosity();
+
+    lua_pushinteger(L, verbosity);
 
     return 1;
 }
 
 static int
-l_kiwmi_server_output_at(lua_State *L)
+l_kiwmi_server_view_at(lua_State *L)
 {
     struct kiwmi_object *obj =
         *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
@@ -128,13 +1095,17 @@ l_kiwmi_server_output_at(lua_State *L)
     double lx = lua_tonumber(L, 2);
     double ly = lua_tonumber(L, 3);
 
-    struct wlr_output *wlr_output =
-        wlr_output_layout_output_at(server->desktop.output_layout, lx, ly);
+    struct wlr_surface *surface;
+    double sx;
+    double sy;
 
-    if (wlr_output) {
-        lua_pushcfunction(L, luaK_kiwmi_output_new);
+    struct kiwmi_view *view =
+        view_at(&server->desktop, lx, ly, &surface, &sx, &sy);
+
+    if (view) {
+        lua_pushcfunction(L, luaK_kiwmi_view_new);
         lua_pushlightuserdata(L, obj->lua);
-        lua_pushlightuserdata(L, wlr_output->data);
+        lua_pushlightuserdata(L, view);
         if (lua_pcall(L, 2, 1, 0)) {
             wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
             return 0;
@@ -146,205 +1117,261 @@ l_kiwmi_server_output_at(lua_State *L)
     return 1;
 }
 
+/**
+ * Resumes the coroutine stored in the first upvalue with the event's
+ * arguments, then unregisters itself via the handle in the second one.
+ */
 static int
-l_kiwmi_server_quit(lua_State *L)
+kiwmi_server_wait_event_resume(lua_State *L)
 {
-    struct kiwmi_object *obj =
-        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    lua_State *co = lua_tothread(L, lua_upvalueindex(1));
+    if (!co) {
+        return 0;
+    }
 
-    struct kiwmi_server *server = obj->object;
+    int nargs = lua_gettop(L);
 
-    wl_display_terminate(server->wl_display);
+    // keep the coroutine alive while it runs
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+
+    lua_pushnil(L);
+    lua_replace(L, lua_upvalueindex(1));
+
+    struct kiwmi_object *obj = *(struct kiwmi_object **)luaL_checkudata(
+        L, lua_upvalueindex(2), "kiwmi_lua_callback");
+    if (obj->valid) {
+        luaK_kiwmi_lua_callback_destroy(obj->object);
+    }
+
+    if (lua_status(co) == LUA_YIELD) {
+        lua_xmove(L, co, nargs);
+        luaK_resume(obj->lua, co, nargs);
+    }
 
     return 0;
 }
 
 static int
-kiwmi_server_schedule_handler(void *data)
+l_kiwmi_server_wait_event(lua_State *L)
 {
-    struct kiwmi_lua_callback *lc = data;
-    lua_State *L                  = lc->server->lua->L;
+    luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TUSERDATA); // object
+    luaL_checktype(L, 3, LUA_TSTRING);   // event
 
-    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
-    lua_pushvalue(L, -1);
-    if (lua_pcall(L, 1, 0, 0)) {
-        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+    if (lua_pushthread(L)) {
+        return luaL_error(
+            L, "kiwmi:wait_event() must be called from kiwmi:async()");
     }
 
-    wl_event_source_remove(lc->event_source);
+    lua_pushnil(L); // replaced by the handle
+    lua_pushcclosure(L, kiwmi_server_wait_event_resume, 2);
+    int resume = lua_gettop(L);
 
-    luaL_unref(L, LUA_REGISTRYINDEX, lc->callback_ref);
+    lua_pushcfunction(L, luaK_callback_register_dispatch);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_pushvalue(L, resume);
+    lua_call(L, 3, 1);
+
+    if (!luaK_toudata(L, -1, "kiwmi_lua_callback")) {
+        return luaL_error(L, "failed to wait for event");
+    }
 
-    wl_list_remove(&lc->link);
-    free(lc);
+    lua_setupvalue(L, resume, 2);
 
-    return 0;
+    return lua_yield(L, 0);
 }
 
 static int
-l_kiwmi_server_schedule(lua_State *L)
+kiwmi_server_wait_fd_handler(int UNUSED(fd), uint32_t mask, void *data)
 {
-    struct kiwmi_object *obj =
-        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
-    luaL_checktype(L, 2, LUA_TNUMBER);   // delay
-    luaL_checktype(L, 3, LUA_TFUNCTION); // callback
-
-    struct kiwmi_server *server = obj->object;
-
-    struct kiwmi_lua_callback *lc = malloc(sizeof(*lc));
-    if (!lc) {
-        return luaL_error(L, "failed to allocate kiwmi_lua_callback");
-    }
-
-    int delay = lua_tonumber(L, 2);
+    struct kiwmi_lua_callback *lc = data;
+    struct kiwmi_lua *lua         = lc->server->lua;
+    lua_State *L                  = lua->L;
 
-    lc->event_source = wl_event_loop_add_timer(
-        server->wl_event_loop, kiwmi_server_schedule_handler, lc);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+    luaK_kiwmi_lua_callback_destroy(lc);
 
-    if (wl_event_source_timer_update(lc->event_source, delay) < 0) {
-        free(lc);
-        return luaL_error(L, "failed to arm timer");
+    lua_State *co = lua_tothread(L, -1);
+    if (lua_status(co) == LUA_YIELD) {
+        lua_pushboolean(co, mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
+        luaK_resume(lua, co, 1);
     }
 
-    lc->server       = server;
-    lc->callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-
-    wl_list_insert(&server->lua->scheduled_callbacks, &lc->link);
+    lua_pop(L, 1);
 
     return 0;
 }
 
 static int
-l_kiwmi_server_set_verbosity(lua_State *L)
+l_kiwmi_server_wait_fd(lua_State *L)
 {
-    luaL_checkudata(L, 1, "kiwmi_server");
-    luaL_checktype(L, 2, LUA_TNUMBER);
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    int fd        = luaL_checkinteger(L, 2);
+    uint32_t mask = fd_mask_from_lua(L, 3, "r");
 
-    int verbosity = lua_tointeger(L, 2);
+    struct kiwmi_server *server = obj->object;
 
-    if (verbosity < WLR_SILENT) {
-        verbosity = WLR_SILENT;
-    } else if (verbosity >= WLR_LOG_IMPORTANCE_LAST) {
-        verbosity = WLR_DEBUG;
+    if (lua_pushthread(L)) {
+        return luaL_error(
+            L, "kiwmi:wait_fd() must be called from kiwmi:async()");
     }
 
-    wlr_log_init((enum wlr_log_importance)verbosity, NULL);
+    fd_callback_new(L, server, fd, mask, kiwmi_server_wait_fd_handler);
 
-    return 0;
+    return lua_yield(L, 0);
 }
 
 static int
-l_kiwmi_server_spawn(lua_State *L)
+kiwmi_server_watch_fd_handler(int UNUSED(fd), uint32_t mask, void *data)
 {
-    luaL_checkudata(L, 1, "kiwmi_server");
-    luaL_checktype(L, 2, LUA_TSTRING);
+    struct kiwmi_lua_callback *lc = data;
+    struct kiwmi_lua *lua         = lc->server->lua;
+    lua_State *L                  = lua->L;
 
-    const char *command = lua_tostring(L, 2);
+    bool hangup = mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR);
 
-    pid_t pid = fork();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+    lua_pushboolean(L, hangup);
 
-    if (pid < 0) {
-        return luaL_error(L, "Failed to run command (fork)");
+    // a hangup is reported for as long as the fd is watched, so only once
+    if (hangup) {
+        luaK_kiwmi_lua_callback_destroy(lc);
     }
 
-    if (pid == 0) {
-        execl("/bin/sh", "/bin/sh", "-c", command, NULL);
-        _exit(EXIT_FAILURE);
+    if (luaK_pcall(lua, 1, 0, "watch_fd")) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1);
     }
 
-    lua_pushinteger(L, pid);
-
-    return 1;
+    return 0;
 }
 
 static int
-l_kiwmi_server_stop_interactive(lua_State *L)
+l_kiwmi_server_watch_fd(lua_State *L)
 {
     struct kiwmi_object *obj =
         *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    int fd        = luaL_checkinteger(L, 2);
+    uint32_t mask = fd_mask_from_lua(L, 3, NULL);
+    luaL_checktype(L, 4, LUA_TFUNCTION); // callback
 
     struct kiwmi_server *server = obj->object;
 
-    server->input.cursor->cursor_mode = KIWMI_CURSOR_PASSTHROUGH;
+    lua_pushvalue(L, 4);
+    struct kiwmi_lua_callback *lc =
+        fd_callback_new(L, server, fd, mask, kiwmi_server_watch_fd_handler);
 
-    return 0;
+    lua_pushcfunction(L, luaK_kiwmi_lua_callback_handle);
+    lua_pushlightuserdata(L, obj->lua);
+    lua_pushlightuserdata(L, lc);
+    if (lua_pcall(L, 2, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 1;
 }
 
 static int
-l_kiwmi_server_unfocus(lua_State *L)
+l_kiwmi_server_watchdog(lua_State *L)
 {
     struct kiwmi_object *obj =
         *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
 
-    struct kiwmi_server *server = obj->object;
+    struct kiwmi_watchdog *watchdog = &obj->lua->watchdog;
 
-    seat_focus_view(server->input.seat, NULL);
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
 
-    return 0;
-}
+        lua_getfield(L, 2, "instructions");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_isnumber(L, -1), 2, "invalid instructions");
+            watchdog->instructions = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
 
-static int
-l_kiwmi_server_verbosity(lua_State *L)
-{
-    luaL_checkudata(L, 1, "kiwmi_server");
+        lua_getfield(L, 2, "strikes");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_isnumber(L, -1), 2, "invalid strikes");
+            watchdog->strikes = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
 
-    int verbosity = (int)wlr_log_get_verbosity();
+        luaK_watchdog_reset(obj->lua);
+    }
 
-    lua_pushinteger(L, verbosity);
+    lua_newtable(L);
+    lua_pushinteger(L, watchdog->instructions);
+    lua_setfield(L, -2, "instructions");
+    lua_pushinteger(L, watchdog->strikes);
+    lua_setfield(L, -2, "strikes");
 
     return 1;
 }
 
 static int
-l_kiwmi_server_view_at(lua_State *L)
+l_kiwmi_server_write_fd(lua_State *L)
 {
-    struct kiwmi_object *obj =
-        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
-    luaL_checktype(L, 2, LUA_TNUMBER); // lx
-    luaL_checktype(L, 3, LUA_TNUMBER); // ly
-
-    struct kiwmi_server *server = obj->object;
-
-    double lx = lua_tonumber(L, 2);
-    double ly = lua_tonumber(L, 3);
+    luaL_checkudata(L, 1, "kiwmi_server");
+    int fd = luaL_checkinteger(L, 2);
 
-    struct wlr_surface *surface;
-    double sx;
-    double sy;
+    size_t size;
+    const char *data = luaL_checklstring(L, 3, &size);
 
-    struct kiwmi_view *view =
-        view_at(&server->desktop, lx, ly, &surface, &sx, &sy);
+    if (!fd_ready(fd, POLLOUT)) {
+        return push_errno(L);
+    }
 
-    if (view) {
-        lua_pushcfunction(L, luaK_kiwmi_view_new);
-        lua_pushlightuserdata(L, obj->lua);
-        lua_pushlightuserdata(L, view);
-        if (lua_pcall(L, 2, 1, 0)) {
-            wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
-            return 0;
-        }
-    } else {
-        lua_pushnil(L);
+    ssize_t len = fd_write_nonblocking(fd, data, size);
+    if (len < 0) {
+        return push_errno(L);
     }
 
+    lua_pushinteger(L, len);
+
     return 1;
 }
 
 static const luaL_Reg kiwmi_server_methods[] = {
     {"active_output", l_kiwmi_server_active_output},
+    {"async", l_kiwmi_server_async},
     {"bg_color", l_kiwmi_server_bg_color},
     {"cursor", l_kiwmi_server_cursor},
+    {"defer", l_kiwmi_server_defer},
+    {"emit", l_kiwmi_server_emit},
     {"focused_view", l_kiwmi_server_focused_view},
+    {"frame_gc", l_kiwmi_server_frame_gc},
+    {"ipc_cache", l_kiwmi_server_ipc_cache},
+    {"ipc_limits", l_kiwmi_server_ipc_limits},
+    {"ipc_stats", l_kiwmi_server_ipc_stats},
+    {"memory", l_kiwmi_server_memory},
     {"on", luaK_callback_register_dispatch},
     {"output_at", l_kiwmi_server_output_at},
+    {"profile", l_kiwmi_server_profile},
+    {"profile_report", l_kiwmi_server_profile_report},
+    {"profile_reset", l_kiwmi_server_profile_reset},
     {"quit", l_kiwmi_server_quit},
+    {"read_fd", l_kiwmi_server_read_fd},
+    {"reload", l_kiwmi_server_reload},
     {"schedule", l_kiwmi_server_schedule},
     {"set_verbosity", l_kiwmi_server_set_verbosity},
+    {"sleep", l_kiwmi_server_sleep},
     {"spawn", l_kiwmi_server_spawn},
+    {"spawn_async", l_kiwmi_server_spawn_async},
     {"stop_interactive", l_kiwmi_server_stop_interactive},
+    {"texture_memory", l_kiwmi_server_texture_memory},
+    {"texture_policy", l_kiwmi_server_texture_policy},
     {"unfocus", l_kiwmi_server_unfocus},
     {"verbosity", l_kiwmi_server_verbosity},
     {"view_at", l_kiwmi_server_view_at},
+    {"wait_event", l_kiwmi_server_wait_event},
+    {"wait_fd", l_kiwmi_server_wait_fd},
+    {"watch_fd", l_kiwmi_server_watch_fd},
+    {"watchdog", l_kiwmi_server_watchdog},
+    {"write_fd", l_kiwmi_server_write_fd},
     {NULL, NULL},
 };
 
@@ -367,7 +1394,7 @@ kiwmi_server_on_keyboard_notify(struct wl_listener *listener, void *data)
         return;
     }
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "keyboard")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -392,7 +1419,7 @@ kiwmi_server_on_output_notify(struct wl_listener *listener, void *data)
         return;
     }
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "output")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -409,7 +1436,7 @@ kiwmi_server_on_request_active_output_notify(
     struct kiwmi_output **output  = data;
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
-    if (lua_pcall(L, 0, 1, 0)) {
+    if (luaK_pcall(server->lua, 0, 1, "request_active_output")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return;
     }
@@ -455,7 +1482,7 @@ kiwmi_server_on_view_notify(struct wl_listener *listener, void *data)
         return;
     }
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "view")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -477,12 +1504,12 @@ l_kiwmi_server_on_keyboard(lua_State *L)
     lua_pushlightuserdata(L, &server->input.events.keyboard_new);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -501,12 +1528,12 @@ l_kiwmi_server_on_output(lua_State *L)
     lua_pushlightuserdata(L, &server->desktop.events.new_output);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -525,12 +1552,12 @@ l_kiwmi_server_on_request_active_output(lua_State *L)
     lua_pushlightuserdata(L, &server->desktop.events.request_active_output);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -549,12 +1576,12 @@ l_kiwmi_server_on_view(lua_State *L)
     lua_pushlightuserdata(L, &server->desktop.events.view_map);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static const luaL_Reg kiwmi_server_events[] = {
@@ -586,6 +1613,72 @@ luaK_kiwmi_server_new(lua_State *L)
     return 1;
 }
 
+static void
+replay_event(struct kiwmi_object *obj, wl_notify_func_t notify, void *data)
+{
+    // callbacks are prepended, signals call them in the order of adding
+    struct kiwmi_lua_callback *lc;
+    struct kiwmi_lua_callback *tmp;
+    wl_list_for_each_reverse_safe (lc, tmp, &obj->callbacks, link) {
+        if (lc->listener.notify == notify) {
+            notify(&lc->listener, data);
+        }
+    }
+}
+
+/**
+ * Emits the keyboard, output and view events a freshly loaded config would
+ * have seen for what already exists, oldest first.
+ */
+void
+luaK_kiwmi_server_replay(struct kiwmi_lua *lua)
+{
+    lua_State *L                = lua->L;
+    struct kiwmi_server *server = lua->server;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->objects);
+    lua_pushlightuserdata(L, server);
+    lua_rawget(L, -2);
+    struct kiwmi_object *obj = lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    if (!obj) {
+        return;
+    }
+
+    struct kiwmi_output *output;
+    wl_list_for_each_reverse (output, &server->desktop.outputs, link) {
+        replay_event(obj, kiwmi_server_on_output_notify, output);
+    }
+
+    struct kiwmi_keyboard *keyboard;
+    wl_list_for_each_reverse (keyboard, &server->input.keyboards, link) {
+        replay_event(obj, kiwmi_server_on_keyboard_notify, keyboard);
+    }
+
+    // focusing a view reorders the list, so walk a copy
+    int len                   = wl_list_length(&server->desktop.views);
+    struct kiwmi_view **views = calloc(len ? len : 1, sizeof(*views));
+    if (!views) {
+        wlr_log(WLR_ERROR, "Failed to allocate views to replay");
+        return;
+    }
+
+    int mapped = 0;
+    struct kiwmi_view *view;
+    wl_list_for_each_reverse (view, &server->desktop.views, link) {
+        if (view->mapped) {
+            views[mapped++] = view;
+        }
+    }
+
+    for (int i = 0; i < mapped; ++i) {
+        replay_event(obj, kiwmi_server_on_view_notify, views[i]);
+    }
+
+    free(views);
+}
+
 int
 luaK_kiwmi_server_register(lua_State *L)
 {
@@ -16,6 +16,7 @@
 #include <wlr/util/log.h>
 
 #include "desktop/output.h"
+#include "desktop/textures.h"
 #include "desktop/view.h"
 #include "desktop/xdg_shell.h"
 #include "input/seat.h"
@@ -138,7 +139,7 @@ l_kiwmi_view_hide(lua_State *L)
 
     struct kiwmi_view *view = obj->object;
 
-    view->hidden = true;
+    view_set_hidden(view, true);
 
     return 0;
 }
@@ -316,7 +317,7 @@ l_kiwmi_view_show(lua_State *L)
 
     struct kiwmi_view *view = obj->object;
 
-    view->hidden = false;
+    view_set_hidden(view, false);
 
     return 0;
 }
@@ -343,6 +344,23 @@ l_kiwmi_view_size(lua_State *L)
     return 2;
 }
 
+static int
+l_kiwmi_view_texture_memory(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_view");
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_view no longer valid");
+    }
+
+    struct kiwmi_view *view = obj->object;
+
+    lua_pushinteger(L, textures_view_size(view));
+
+    return 1;
+}
+
 static int
 l_kiwmi_view_tiled(lua_State *L)
 {
@@ -440,6 +458,7 @@ static const luaL_Reg kiwmi_view_methods[] = {
     {"resize", l_kiwmi_view_resize},
     {"show", l_kiwmi_view_show},
     {"size", l_kiwmi_view_size},
+    {"texture_memory", l_kiwmi_view_texture_memory},
     {"tiled", l_kiwmi_view_tiled},
     {"title", l_kiwmi_view_title},
     {NULL, NULL},
@@ -465,7 +484,7 @@ kiwmi_view_on_destroy_notify(struct wl_listener *listener, void *data)
         return;
     }
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "view.destroy")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -524,7 +543,7 @@ kiwmi_view_on_render_notify(struct wl_listener *listener, void *data)
 
     lua_setfield(L, -2, "renderer");
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "view.render")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -550,7 +569,7 @@ kiwmi_view_on_request_move_notify(struct wl_listener *listener, void *data)
         return;
     }
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "view.request_move")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -607,7 +626,7 @@ kiwmi_view_on_request_resize_notify(struct wl_listener *listener, void *data)
 
     lua_setfield(L, -2, "edges");
 
-    if (lua_pcall(L, 1, 0, 0)) {
+    if (luaK_pcall(server->lua, 1, 0, "view.request_resize")) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_pop(L, 1);
     }
@@ -635,12 +654,12 @@ l_kiwmi_view_on_destroy(lua_State *L)
     lua_pushlightuserdata(L, &obj->events.destroy);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -665,12 +684,12 @@ l_kiwmi_view_on_post_render(lua_State *L)
     lua_pushlightuserdata(L, &view->events.post_render);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -695,12 +714,12 @@ l_kiwmi_view_on_pre_render(lua_State *L)
     lua_pushlightuserdata(L, &view->events.pre_render);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -725,12 +744,12 @@ l_kiwmi_view_on_request_move(lua_State *L)
     lua_pushlightuserdata(L, &view->events.request_move);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int
@@ -755,12 +774,12 @@ l_kiwmi_view_on_request_resize(lua_State *L)
     lua_pushlightuserdata(L, &view->events.request_resize);
     lua_pushlightuserdata(L, obj);
 
-    if (lua_pcall(L, 5, 0, 0)) {
+    if (lua_pcall(L, 5, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static const luaL_Reg kiwmi_view_events[] = {
@@ -9,6 +9,20 @@
 
 #include <stdlib.h>
 
+int
+luaC_resume(lua_State *L, lua_State *from, int nargs)
+{
+#if LUA_VERSION_NUM >= 504
+    int nresults;
+    return lua_resume(L, from, nargs, &nresults);
+#elif LUA_VERSION_NUM >= 502
+    return lua_resume(L, from, nargs);
+#else
+    (void)from;
+    return lua_resume(L, nargs);
+#endif
+}
+
 void
 luaC_setfuncs(lua_State *L, const luaL_Reg *l, int nup)
 {
@@ -22,3 +36,31 @@ luaC_setfuncs(lua_State *L, const luaL_Reg *l, int nup)
     }
     lua_pop(L, nup);
 }
+
+/**
+ * Pushes 'msg' with a traceback starting at the currently running function.
+ */
+void
+luaC_traceback(lua_State *L, const char *msg)
+{
+#if LUA_VERSION_NUM >= 502
+    luaL_traceback(L, L, msg, 0);
+#else
+    lua_getglobal(L, "debug");
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "traceback");
+        if (lua_isfunction(L, -1)) {
+            lua_pushstring(L, msg);
+            lua_pushinteger(L, 1);
+            if (!lua_pcall(L, 2, 1, 0) && lua_isstring(L, -1)) {
+                lua_remove(L, -2);
+                return;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    lua_pushstring(L, msg);
+#endif
+}
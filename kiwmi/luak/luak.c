@@ -7,20 +7,27 @@
 
 #include "luak/luak.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <lauxlib.h>
 #include <lualib.h>
 #include <wlr/util/log.h>
 
+#include "luak/bytecode_cache.h"
+#include "luak/gc.h"
 #include "luak/ipc.h"
 #include "luak/kiwmi_cursor.h"
 #include "luak/kiwmi_keyboard.h"
 #include "luak/kiwmi_lua_callback.h"
 #include "luak/kiwmi_output.h"
+#include "luak/kiwmi_process.h"
 #include "luak/kiwmi_renderer.h"
 #include "luak/kiwmi_server.h"
 #include "luak/kiwmi_view.h"
+#include "luak/lua_compat.h"
+#include "luak/profiler.h"
+#include "timer.h"
 
 void *
 luaK_toudata(lua_State *L, int ud, const char *tname)
@@ -45,6 +52,19 @@ kiwmi_object_destroy(struct kiwmi_object *obj)
     wl_list_remove(&obj->destroy.link);
     wl_list_remove(&obj->events.destroy.listener_list);
 
+    lua_State *L = obj->lua->L;
+
+    // the next lookup of the same pointer must not find a freed object
+    lua_rawgeti(L, LUA_REGISTRYINDEX, obj->lua->objects);
+    lua_pushlightuserdata(L, obj->object);
+    lua_rawget(L, -2);
+    if (lua_touserdata(L, -1) == obj) {
+        lua_pushlightuserdata(L, obj->object);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 2);
+
     free(obj);
 }
 
@@ -67,17 +87,16 @@ kiwmi_object_destroy_notify(struct wl_listener *listener, void *data)
 {
     struct kiwmi_object *obj = wl_container_of(listener, obj, destroy);
 
+    // the signal goes away with the object, don't leave a dangling link
+    wl_list_remove(&obj->destroy.link);
+    wl_list_init(&obj->destroy.link);
+
     wl_signal_emit(&obj->events.destroy, data);
 
     struct kiwmi_lua_callback *lc;
     struct kiwmi_lua_callback *tmp;
     wl_list_for_each_safe (lc, tmp, &obj->callbacks, link) {
-        wl_list_remove(&lc->listener.link);
-        wl_list_remove(&lc->link);
-
-        luaL_unref(lc->server->lua->L, LUA_REGISTRYINDEX, lc->callback_ref);
-
-        free(lc);
+        luaK_kiwmi_lua_callback_destroy(lc);
     }
 
     lua_State *L = obj->lua->L;
@@ -186,6 +205,338 @@ luaK_usertype_ref_equal(lua_State *L)
     return 1;
 }
 
+#define WATCHDOG_SLICE 1000 // instructions between two checks
+
+static void
+function_source(lua_State *L, int index, char *source, size_t size)
+{
+    lua_pushvalue(L, index);
+    if (lua_isfunction(L, -1)) {
+        lua_Debug ar;
+        lua_getinfo(L, ">S", &ar); // pops the function
+        snprintf(source, size, "%s:%d", ar.short_src, ar.linedefined);
+    } else {
+        lua_pop(L, 1);
+        snprintf(source, size, "?");
+    }
+}
+
+static int
+profiled_pcall(
+    struct kiwmi_lua *lua,
+    int nargs,
+    int nresults,
+    const char *event)
+{
+    lua_State *L                    = lua->L;
+    struct kiwmi_profiler *profiler = &lua->profiler;
+
+    if (!profiler->enabled) {
+        return lua_pcall(L, nargs, nresults, 0);
+    }
+
+    char source[KIWMI_PROFILER_SOURCE_SIZE];
+    function_source(L, -(nargs + 1), source, sizeof(source));
+
+    uint64_t requested = lua->allocator.requested;
+    uint64_t start     = timer_now();
+
+    int error = lua_pcall(L, nargs, nresults, 0);
+
+    // the callback may have turned the profiler off
+    if (profiler->enabled) {
+        luaK_profiler_record(
+            profiler,
+            event,
+            source,
+            timer_now() - start,
+            lua->allocator.requested - requested);
+    }
+
+    return error;
+}
+
+/**
+ * Charges every thread running under the watchdog to the same budget, so
+ * coroutines started by a callback can't escape it.
+ */
+static void
+watchdog_hook(lua_State *L, lua_Debug *UNUSED(ar))
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, "kiwmi_lua");
+    struct kiwmi_lua *lua = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    struct kiwmi_watchdog *watchdog = &lua->watchdog;
+
+    if (watchdog->depth == 0) {
+        // a coroutine that inherited the hook, but isn't guarded right now
+        lua_sethook(L, NULL, 0, 0);
+        return;
+    }
+
+    if (!watchdog->tripped) {
+        watchdog->used += WATCHDOG_SLICE;
+        if (watchdog->used < watchdog->instructions) {
+            return;
+        }
+        watchdog->tripped = true;
+    }
+
+    // raised again every slice, in case the callback catches it
+    luaC_traceback(L, "instruction budget exceeded");
+    lua_error(L);
+}
+
+static void
+watchdog_enter(struct kiwmi_lua *lua, lua_State *thread)
+{
+    struct kiwmi_watchdog *watchdog = &lua->watchdog;
+
+    if (watchdog->depth++ == 0) {
+        watchdog->used    = 0;
+        watchdog->tripped = false;
+    }
+
+    lua_sethook(thread, watchdog_hook, LUA_MASKCOUNT, WATCHDOG_SLICE);
+}
+
+static void
+watchdog_leave(struct kiwmi_lua *lua, lua_State *thread)
+{
+    --lua->watchdog.depth;
+
+    // the main thread is still running the outer call
+    if (thread != lua->L || lua->watchdog.depth == 0) {
+        lua_sethook(thread, NULL, 0, 0);
+    }
+}
+
+static int
+watchdog_strikes(struct kiwmi_lua *lua, int function)
+{
+    lua_State *L = lua->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->watchdog.offenders);
+    lua_pushvalue(L, function);
+    lua_rawget(L, -2);
+    int strikes = lua_tointeger(L, -1);
+    lua_pop(L, 2);
+
+    return strikes;
+}
+
+static void
+watchdog_strike(struct kiwmi_lua *lua, int function)
+{
+    lua_State *L = lua->L;
+
+    if (!lua_isfunction(L, function)) {
+        return;
+    }
+
+    int strikes = watchdog_strikes(lua, function) + 1;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->watchdog.offenders);
+    lua_pushvalue(L, function);
+    lua_pushinteger(L, strikes);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    if (strikes == lua->watchdog.strikes) {
+        char source[KIWMI_PROFILER_SOURCE_SIZE];
+        function_source(L, function, source, sizeof(source));
+        wlr_log(
+            WLR_ERROR,
+            "Disabling callback %s after %d aborted calls",
+            source,
+            strikes);
+    }
+}
+
+/**
+ * Runs the callbacks passed to kiwmi:defer() so far. Anything they defer
+ * waits for the next cycle of the event loop, as a new idle source would
+ * still be run by the current wl_event_loop_dispatch_idle().
+ */
+void
+luaK_run_deferred(struct kiwmi_lua *lua)
+{
+    lua_State *L = lua->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->deferred);
+
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, lua->deferred);
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, lua->deferred_keys);
+
+    lua->deferring = true;
+
+    size_t len = luaC_rawlen(L, -1);
+    for (size_t i = 1; i <= len; ++i) {
+        lua_rawgeti(L, -1, i);
+        if (luaK_pcall(lua, 0, 0, "defer")) {
+            wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+
+    lua->deferring = false;
+
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->deferred);
+    if (luaC_rawlen(L, -1) > 0) {
+        timer_arm(&lua->deferred_timer, 0, 0);
+    }
+    lua_pop(L, 1);
+}
+
+static void
+luaK_defer_timer(struct kiwmi_timer *UNUSED(timer), void *data)
+{
+    luaK_run_deferred(data);
+}
+
+/**
+ * Forgets about aborted callbacks, which re-enables the disabled ones.
+ */
+void
+luaK_watchdog_reset(struct kiwmi_lua *lua)
+{
+    lua_State *L = lua->L;
+
+    lua_newtable(L);
+
+    // don't keep dead callbacks alive
+    lua_newtable(L);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+
+    lua_rawseti(L, LUA_REGISTRYINDEX, lua->watchdog.offenders);
+}
+
+/**
+ * lua_pcall() for user code. The call is aborted once it exceeds the
+ * watchdog's budget and, while the profiler is enabled, accounted to 'event'
+ * and the location the called function was defined at.
+ */
+int
+luaK_pcall(struct kiwmi_lua *lua, int nargs, int nresults, const char *event)
+{
+    lua_State *L                    = lua->L;
+    struct kiwmi_watchdog *watchdog = &lua->watchdog;
+
+    if (watchdog->instructions <= 0) {
+        return profiled_pcall(lua, nargs, nresults, event);
+    }
+
+    int function = lua_gettop(L) - nargs;
+
+    if (watchdog->strikes > 0
+        && watchdog_strikes(lua, function) >= watchdog->strikes) {
+        // behave like a callback that returned nothing
+        lua_settop(L, function - 1);
+        for (int i = 0; i < nresults; ++i) {
+            lua_pushnil(L);
+        }
+        return 0;
+    }
+
+    // keep a reference to blame the callback if it gets aborted
+    lua_pushvalue(L, function);
+    lua_insert(L, function);
+
+    watchdog_enter(lua, L);
+    int error = profiled_pcall(lua, nargs, nresults, event);
+    watchdog_leave(lua, L);
+
+    if (error && watchdog->tripped) {
+        watchdog_strike(lua, function);
+    }
+
+    lua_remove(L, function);
+
+    return error;
+}
+
+/**
+ * Resumes 'co' with the 'nargs' values on top of its stack and reports
+ * errors, as nobody else will.
+ */
+int
+luaK_resume(struct kiwmi_lua *lua, lua_State *co, int nargs)
+{
+    bool guarded = lua->watchdog.instructions > 0;
+
+    if (guarded) {
+        watchdog_enter(lua, co);
+    }
+
+    int status = luaC_resume(co, lua->L, nargs);
+
+    if (guarded) {
+        watchdog_leave(lua, co);
+    }
+
+    if (status == LUA_YIELD) {
+        return status;
+    }
+
+    if (status != 0) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(co, -1));
+    }
+
+    lua_settop(co, 0);
+
+    return status;
+}
+
+/**
+ * The Lua state outlives the display, so event sources have to be dropped
+ * while the loop still exists.
+ */
+static void
+event_loop_destroy_notify(struct wl_listener *listener, void *UNUSED(data))
+{
+    struct kiwmi_lua *lua = wl_container_of(listener, lua, event_loop_destroy);
+
+    struct kiwmi_lua_callback *lc;
+    struct kiwmi_lua_callback *tmp;
+    wl_list_for_each_safe (lc, tmp, &lua->scheduled_callbacks, link) {
+        luaK_kiwmi_lua_callback_destroy(lc);
+    }
+
+    if (lua->deferred_idle) {
+        wl_event_source_remove(lua->deferred_idle);
+        lua->deferred_idle = NULL;
+    }
+    timer_disarm(&lua->deferred_timer);
+
+    if (lua->reload_idle) {
+        wl_event_source_remove(lua->reload_idle);
+        lua->reload_idle = NULL;
+    }
+
+    luaK_gc_fini(&lua->gc);
+
+    wl_list_remove(&lua->event_loop_destroy.link);
+    wl_list_init(&lua->event_loop_destroy.link);
+}
+
+static int
+kiwmi_lua_panic(lua_State *L)
+{
+    const char *message = lua_tostring(L, -1);
+    wlr_log(
+        WLR_ERROR,
+        "Unprotected error in Lua: %s",
+        message ? message : "(error object is not a string)");
+    return 0;
+}
+
 struct kiwmi_lua *
 luaK_create(struct kiwmi_server *server)
 {
@@ -195,15 +546,28 @@ luaK_create(struct kiwmi_server *server)
         return NULL;
     }
 
-    lua_State *L = luaL_newstate();
+    luaK_allocator_init(&lua->allocator);
+    luaK_ipc_cache_init(&lua->ipc_cache);
+    luaK_profiler_init(&lua->profiler);
+
+    lua_State *L = lua_newstate(luaK_allocator_alloc, &lua->allocator);
+    if (!L) {
+        // LuaJIT on 64 bit insists on its own allocator
+        L = luaL_newstate();
+    }
     if (!L) {
         free(lua);
         return NULL;
     }
 
-    lua->L = L;
+    lua_atpanic(L, kiwmi_lua_panic);
+
+    lua->L           = L;
+    lua->server      = server;
+    lua->reload_idle = NULL;
 
     luaL_openlibs(L);
+    luaK_bytecode_cache_install(L);
 
     wl_list_init(&lua->scheduled_callbacks);
 
@@ -211,6 +575,27 @@ luaK_create(struct kiwmi_server *server)
     lua_newtable(L);
     lua->objects = luaL_ref(L, LUA_REGISTRYINDEX);
 
+    lua_pushlightuserdata(L, lua);
+    lua_setfield(L, LUA_REGISTRYINDEX, "kiwmi_lua");
+
+    lua_newtable(L);
+    lua->deferred = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_newtable(L);
+    lua->deferred_keys = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua->deferred_idle = NULL;
+    lua->deferring     = false;
+    timer_init(&lua->deferred_timer, &server->timers, luaK_defer_timer, lua);
+
+    lua->watchdog.instructions = 0;
+    lua->watchdog.strikes      = 0;
+    lua->watchdog.depth        = 0;
+    lua->watchdog.used         = 0;
+    lua->watchdog.tripped      = false;
+
+    lua_newtable(L);
+    lua->watchdog.offenders = luaL_ref(L, LUA_REGISTRYINDEX);
+    luaK_watchdog_reset(lua);
+
     // register types
     int error = 0;
 
@@ -218,8 +603,12 @@ luaK_create(struct kiwmi_server *server)
     error |= lua_pcall(L, 0, 0, 0);
     lua_pushcfunction(L, luaK_kiwmi_keyboard_register);
     error |= lua_pcall(L, 0, 0, 0);
+    lua_pushcfunction(L, luaK_kiwmi_lua_callback_register);
+    error |= lua_pcall(L, 0, 0, 0);
     lua_pushcfunction(L, luaK_kiwmi_output_register);
     error |= lua_pcall(L, 0, 0, 0);
+    lua_pushcfunction(L, luaK_kiwmi_process_register);
+    error |= lua_pcall(L, 0, 0, 0);
     lua_pushcfunction(L, luaK_kiwmi_renderer_register);
     error |= lua_pcall(L, 0, 0, 0);
     lua_pushcfunction(L, luaK_kiwmi_server_register);
@@ -230,6 +619,8 @@ luaK_create(struct kiwmi_server *server)
     if (error) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_close(L);
+        luaK_allocator_fini(&lua->allocator);
+        free(lua);
         return NULL;
     }
 
@@ -244,6 +635,7 @@ luaK_create(struct kiwmi_server *server)
     if (lua_pcall(L, 2, 1, 0)) {
         wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
         lua_close(L);
+        luaK_allocator_fini(&lua->allocator);
         free(lua);
         return NULL;
     }
@@ -253,6 +645,7 @@ luaK_create(struct kiwmi_server *server)
     if (!config_path) {
         wlr_log(WLR_ERROR, "Failed to allocate memory");
         lua_close(L);
+        luaK_allocator_fini(&lua->allocator);
         free(lua);
         return NULL;
     }
@@ -276,16 +669,16 @@ luaK_create(struct kiwmi_server *server)
         // shouldn't fail
         wlr_log(WLR_ERROR, "Error in adjust_package_path");
         lua_close(L);
+        luaK_allocator_fini(&lua->allocator);
         free(lua);
         return NULL;
     }
 
-    if (!luaK_ipc_init(server, lua)) {
-        wlr_log(WLR_ERROR, "Failed to initialize IPC");
-        lua_close(L);
-        free(lua);
-        return NULL;
-    }
+    luaK_gc_init(&lua->gc, L, server);
+
+    lua->event_loop_destroy.notify = event_loop_destroy_notify;
+    wl_event_loop_add_destroy_listener(
+        server->wl_event_loop, &lua->event_loop_destroy);
 
     return lua;
 }
@@ -295,29 +688,132 @@ luaK_dofile(struct kiwmi_lua *lua, const char *config_path)
 {
     int top = lua_gettop(lua->L);
 
-    if (luaL_dofile(lua->L, config_path)) {
+    // no frames are rendered yet, let Lua collect as it goes
+    if (lua->gc.enabled) {
+        lua_gc(lua->L, LUA_GCRESTART, 0);
+    }
+
+    bool error = luaK_bytecode_cache_loadfile(lua->L, config_path)
+              || luaK_pcall(lua, 0, LUA_MULTRET, "config");
+
+    if (lua->gc.enabled) {
+        lua_gc(lua->L, LUA_GCSTOP, 0);
+    }
+
+    if (error) {
         wlr_log(
             WLR_ERROR, "Error running config: %s", lua_tostring(lua->L, -1));
+        lua_settop(lua->L, top);
         return false;
     }
 
-    lua_pop(lua->L, top - lua_gettop(lua->L));
+    lua_settop(lua->L, top);
 
     return true;
 }
 
+/**
+ * Unhooks all callbacks from the compositor. Objects kept alive only by their
+ * callbacks go away with them, the rest is left to lua_close().
+ */
+static void
+release_objects(struct kiwmi_lua *lua)
+{
+    lua_State *L = lua->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->objects);
+
+    // destroying callbacks only clears fields, which lua_next() tolerates
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        struct kiwmi_object *obj = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+
+        if (wl_list_empty(&obj->callbacks)) {
+            continue;
+        }
+
+        struct kiwmi_lua_callback *lc;
+        struct kiwmi_lua_callback *tmp;
+        wl_list_for_each_safe (lc, tmp, &obj->callbacks, link) {
+            luaK_kiwmi_lua_callback_destroy(lc);
+        }
+
+        if (obj->refcount == 0) {
+            kiwmi_object_destroy(obj);
+        }
+    }
+
+    lua_pop(L, 1);
+}
+
+/**
+ * Replaces the Lua state with a fresh one running the config again, and
+ * hands it the outputs, keyboards and views that already exist. The current
+ * state is kept if the config doesn't compile.
+ */
+bool
+luaK_reload(struct kiwmi_lua *lua)
+{
+    struct kiwmi_server *server = lua->server;
+    lua_State *L                = lua->L;
+
+    if (luaK_bytecode_cache_loadfile(L, server->config_path)) {
+        wlr_log(WLR_ERROR, "Not reloading config: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_pop(L, 1);
+
+    struct kiwmi_lua *fresh = luaK_create(server);
+    if (!fresh) {
+        wlr_log(WLR_ERROR, "Failed to create Lua state for reload");
+        return false;
+    }
+
+    wlr_log(WLR_INFO, "Reloading config");
+
+    // callbacks unref themselves through server->lua
+    release_objects(lua);
+    luaK_destroy(lua);
+
+    server->lua = fresh;
+
+    bool ok = luaK_dofile(fresh, server->config_path);
+
+    // even a config that failed halfway may have registered some callbacks
+    luaK_kiwmi_server_replay(fresh);
+
+    return ok;
+}
+
 void
 luaK_destroy(struct kiwmi_lua *lua)
 {
-    lua_close(lua->L);
-
     struct kiwmi_lua_callback *lc;
     struct kiwmi_lua_callback *tmp;
     wl_list_for_each_safe (lc, tmp, &lua->scheduled_callbacks, link) {
-        wl_event_source_remove(lc->event_source);
-        wl_list_remove(&lc->link);
-        free(lc);
+        luaK_kiwmi_lua_callback_destroy(lc);
+    }
+
+    if (lua->deferred_idle) {
+        wl_event_source_remove(lua->deferred_idle);
     }
+    timer_disarm(&lua->deferred_timer);
+
+    if (lua->reload_idle) {
+        wl_event_source_remove(lua->reload_idle);
+    }
+
+    luaK_gc_fini(&lua->gc);
+
+    wl_list_remove(&lua->event_loop_destroy.link);
+
+    lua_close(lua->L);
+
+    luaK_allocator_fini(&lua->allocator);
+    luaK_ipc_cache_fini(&lua->ipc_cache);
+    luaK_profiler_fini(&lua->profiler);
 
     free(lua);
 }
@@ -0,0 +1,225 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "luak/profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+#include <wlr/util/log.h>
+
+#define KIWMI_PROFILER_MAX_ENTRIES 256
+#define KIWMI_PROFILER_OVERFLOW    "(other)"
+
+void
+luaK_profiler_init(struct kiwmi_profiler *profiler)
+{
+    profiler->enabled  = false;
+    profiler->entries  = NULL;
+    profiler->len      = 0;
+    profiler->capacity = 0;
+}
+
+void
+luaK_profiler_fini(struct kiwmi_profiler *profiler)
+{
+    free(profiler->entries);
+
+    profiler->entries  = NULL;
+    profiler->len      = 0;
+    profiler->capacity = 0;
+}
+
+void
+luaK_profiler_reset(struct kiwmi_profiler *profiler)
+{
+    profiler->len = 0;
+}
+
+/**
+ * There are only ever a few dozen callbacks, so a linear search is cheaper
+ * than keeping a hash table around.
+ */
+static struct kiwmi_profiler_entry *
+profiler_entry(
+    struct kiwmi_profiler *profiler,
+    const char *event,
+    const char *source)
+{
+    for (size_t i = 0; i < profiler->len; ++i) {
+        struct kiwmi_profiler_entry *entry = &profiler->entries[i];
+        if (strcmp(entry->event, event) == 0
+            && strcmp(entry->source, source) == 0) {
+            return entry;
+        }
+    }
+
+    // IPC chunks are keyed by their source text, don't let them grow forever
+    if (profiler->len >= KIWMI_PROFILER_MAX_ENTRIES
+        && strcmp(source, KIWMI_PROFILER_OVERFLOW) != 0) {
+        return profiler_entry(profiler, event, KIWMI_PROFILER_OVERFLOW);
+    }
+
+    if (profiler->len == profiler->capacity) {
+        size_t capacity = profiler->capacity ? profiler->capacity * 2 : 16;
+        struct kiwmi_profiler_entry *entries =
+            realloc(profiler->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            wlr_log(WLR_ERROR, "Failed to allocate profiler entry");
+            return NULL;
+        }
+
+        profiler->entries  = entries;
+        profiler->capacity = capacity;
+    }
+
+    struct kiwmi_profiler_entry *entry = &profiler->entries[profiler->len++];
+
+    entry->event = event;
+    snprintf(entry->source, sizeof(entry->source), "%s", source);
+    entry->calls     = 0;
+    entry->total_ns  = 0;
+    entry->max_ns    = 0;
+    entry->allocated = 0;
+
+    return entry;
+}
+
+void
+luaK_profiler_record(
+    struct kiwmi_profiler *profiler,
+    const char *event,
+    const char *source,
+    uint64_t elapsed_ns,
+    uint64_t allocated)
+{
+    struct kiwmi_profiler_entry *entry =
+        profiler_entry(profiler, event, source);
+    if (!entry) {
+        return;
+    }
+
+    ++entry->calls;
+    entry->total_ns += elapsed_ns;
+    entry->allocated += allocated;
+
+    if (elapsed_ns > entry->max_ns) {
+        entry->max_ns = elapsed_ns;
+    }
+}
+
+static int
+entry_compare_total(const void *a, const void *b)
+{
+    const struct kiwmi_profiler_entry *entry_a = a;
+    const struct kiwmi_profiler_entry *entry_b = b;
+
+    if (entry_a->total_ns != entry_b->total_ns) {
+        return entry_a->total_ns < entry_b->total_ns ? 1 : -1;
+    }
+
+    return strcmp(entry_a->source, entry_b->source);
+}
+
+static void
+report_add_entries(
+    luaL_Buffer *buffer,
+    struct kiwmi_profiler_entry *entries,
+    size_t len)
+{
+    qsort(entries, len, sizeof(*entries), entry_compare_total);
+
+    char line[256];
+    for (size_t i = 0; i < len; ++i) {
+        struct kiwmi_profiler_entry *entry = &entries[i];
+        snprintf(
+            line,
+            sizeof(line),
+            "%-26s %8llu %11.3f %9.3f %10.1f  %s\n",
+            entry->event,
+            (unsigned long long)entry->calls,
+            entry->total_ns / 1e6,
+            entry->max_ns / 1e6,
+            entry->allocated / 1024.0,
+            entry->source);
+        luaL_addstring(buffer, line);
+    }
+}
+
+/**
+ * Pushes a human readable report, sorted by total time. Times are wall clock
+ * and include nested callbacks.
+ */
+void
+luaK_profiler_push_report(struct kiwmi_profiler *profiler, lua_State *L)
+{
+    size_t len = profiler->len;
+
+    // owned by Lua, so nothing leaks if building the string raises an error
+    struct kiwmi_profiler_entry *callbacks =
+        lua_newuserdata(L, 2 * len * sizeof(*callbacks));
+    struct kiwmi_profiler_entry *events = callbacks + len;
+
+    if (len) {
+        memcpy(callbacks, profiler->entries, len * sizeof(*callbacks));
+    }
+
+    size_t events_len = 0;
+    for (size_t i = 0; i < len; ++i) {
+        struct kiwmi_profiler_entry *callback = &callbacks[i];
+
+        struct kiwmi_profiler_entry *event = NULL;
+        for (size_t j = 0; j < events_len; ++j) {
+            if (strcmp(events[j].event, callback->event) == 0) {
+                event = &events[j];
+                break;
+            }
+        }
+
+        if (!event) {
+            event = &events[events_len++];
+            *event = *callback;
+            snprintf(event->source, sizeof(event->source), "*");
+            continue;
+        }
+
+        event->calls += callback->calls;
+        event->total_ns += callback->total_ns;
+        event->allocated += callback->allocated;
+
+        if (callback->max_ns > event->max_ns) {
+            event->max_ns = callback->max_ns;
+        }
+    }
+
+    char header[128];
+    snprintf(
+        header,
+        sizeof(header),
+        "%-26s %8s %11s %9s %10s  %s\n",
+        "event",
+        "calls",
+        "total ms",
+        "max ms",
+        "alloc KiB",
+        "source");
+
+    luaL_Buffer buffer;
+    luaL_buffinit(L, &buffer);
+
+    luaL_addstring(&buffer, profiler->enabled ? "" : "(profiler disabled)\n");
+    luaL_addstring(&buffer, header);
+    report_add_entries(&buffer, events, events_len);
+    luaL_addstring(&buffer, "\n");
+    luaL_addstring(&buffer, header);
+    report_add_entries(&buffer, callbacks, len);
+
+    luaL_pushresult(&buffer);
+    lua_remove(L, -2);
+}
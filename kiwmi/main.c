@@ -5,12 +5,12 @@
  * You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <limits.h>
-#include <signal.h>
 #include <unistd.h>
 
 #include <wlr/util/log.h>
@@ -71,13 +71,14 @@ main(int argc, char **argv)
 
     fprintf(stderr, "Using kiwmi v" KIWMI_VERSION "\n");
 
-    signal(SIGCHLD, SIG_IGN); // prevent zombies from kiwmi:spawn()
-
     if (!getenv("XDG_RUNTIME_DIR")) {
         wlr_log(WLR_ERROR, "XDG_RUNTIME_DIR not set");
         exit(EXIT_FAILURE);
     }
 
+    // writing to a pipe whose reader went away mustn't kill the compositor
+    signal(SIGPIPE, SIG_IGN);
+
     struct kiwmi_server server;
 
     if (!server_init(&server, config_path)) {
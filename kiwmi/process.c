@@ -0,0 +1,377 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// for posix_spawn_file_actions_addchdir_np and pipe2
+#define _GNU_SOURCE
+
+#include "process.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <wayland-server.h>
+#include <wlr/util/log.h>
+
+#include "server.h"
+
+extern char **environ;
+
+static bool
+env_name_equal(const char *a, const char *b)
+{
+    size_t a_len = strcspn(a, "=");
+    size_t b_len = strcspn(b, "=");
+
+    return a_len == b_len && strncmp(a, b, a_len) == 0;
+}
+
+/**
+ * Merges the current environment with 'overrides'. Only the array is
+ * allocated, the strings are borrowed from environ and 'overrides'.
+ */
+static char **
+env_merge(char *const *overrides)
+{
+    size_t len = 0;
+    for (char **var = environ; *var; ++var) {
+        ++len;
+    }
+    for (char *const *var = overrides; *var; ++var) {
+        ++len;
+    }
+
+    char **env = malloc((len + 1) * sizeof(*env));
+    if (!env) {
+        return NULL;
+    }
+
+    size_t i = 0;
+    for (char **var = environ; *var; ++var) {
+        bool overridden = false;
+        for (char *const *override = overrides; *override; ++override) {
+            if (env_name_equal(*var, *override)) {
+                overridden = true;
+                break;
+            }
+        }
+
+        if (!overridden) {
+            env[i++] = *var;
+        }
+    }
+
+    for (char *const *override = overrides; *override; ++override) {
+        // a bare name only unsets the variable
+        if (strchr(*override, '=')) {
+            env[i++] = *override;
+        }
+    }
+
+    env[i] = NULL;
+
+    return env;
+}
+
+/**
+ * Spawns a new process without copying the compositor's address space.
+ * Returns the pid, or -1 with errno set if the process could not be started.
+ */
+pid_t
+process_spawn(const struct kiwmi_spawn_options *options)
+{
+    char **env = environ;
+    if (options->env) {
+        env = env_merge(options->env);
+        if (!env) {
+            return -1;
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+
+    // don't leak the compositor's signal setup into the child
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    posix_spawnattr_setflags(
+        &attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    int error = 0;
+    if (options->cwd) {
+        error = posix_spawn_file_actions_addchdir_np(&actions, options->cwd);
+    }
+    if (!error && options->stdout_fd >= 0) {
+        error = posix_spawn_file_actions_adddup2(
+            &actions, options->stdout_fd, STDOUT_FILENO);
+    }
+    if (!error && options->stderr_fd >= 0) {
+        error = posix_spawn_file_actions_adddup2(
+            &actions, options->stderr_fd, STDERR_FILENO);
+    }
+
+    pid_t pid = -1;
+    if (!error) {
+        error = posix_spawnp(
+            &pid, options->argv[0], &actions, &attr, options->argv, env);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (env != environ) {
+        free(env);
+    }
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    return pid;
+}
+
+static void
+process_destroy(struct kiwmi_process *process)
+{
+    wl_signal_emit(&process->events.destroy, process);
+
+    wl_list_remove(&process->link);
+
+    free(process);
+}
+
+/**
+ * The exit event is only emitted once the process has been reaped and both
+ * pipes hit EOF, so no output can arrive after it.
+ */
+static void
+process_maybe_finish(struct kiwmi_process *process)
+{
+    if (!process->exited || process->out.fd >= 0 || process->err.fd >= 0) {
+        return;
+    }
+
+    wl_signal_emit(&process->events.exit, process);
+
+    process_destroy(process);
+}
+
+static void
+process_pipe_close(struct kiwmi_process_pipe *pipe)
+{
+    if (pipe->fd < 0) {
+        return;
+    }
+
+    wl_event_source_remove(pipe->event_source);
+    close(pipe->fd);
+
+    pipe->event_source = NULL;
+    pipe->fd           = -1;
+}
+
+static int
+process_pipe_readable(int fd, uint32_t UNUSED(mask), void *data)
+{
+    struct kiwmi_process_pipe *pipe = data;
+    struct kiwmi_process *process   = pipe->process;
+
+    // a single read per dispatch, so a chatty child can't starve the loop
+    char buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf));
+
+    if (len > 0) {
+        struct kiwmi_process_data_event event = {
+            .process = process,
+            .data    = buf,
+            .len     = len,
+        };
+
+        wl_signal_emit(pipe->signal, &event);
+        return 0;
+    }
+
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+
+    process_pipe_close(pipe);
+    process_maybe_finish(process);
+
+    return 0;
+}
+
+static void
+process_pipe_init(
+    struct kiwmi_process_pipe *pipe,
+    struct kiwmi_process *process,
+    struct wl_signal *signal,
+    int fd)
+{
+    pipe->process      = process;
+    pipe->signal       = signal;
+    pipe->fd           = fd;
+    pipe->event_source = NULL;
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    pipe->event_source = wl_event_loop_add_fd(
+        process->server->wl_event_loop,
+        fd,
+        WL_EVENT_READABLE,
+        process_pipe_readable,
+        pipe);
+    if (!pipe->event_source) {
+        wlr_log(
+            WLR_ERROR, "Failed to watch output of process %d", process->pid);
+        close(fd);
+        pipe->fd = -1;
+    }
+}
+
+/**
+ * Spawns a process with its stdout and stderr connected to pipes on the
+ * event loop. Returns NULL with errno set on failure.
+ */
+struct kiwmi_process *
+process_spawn_async(
+    struct kiwmi_server *server,
+    const struct kiwmi_spawn_options *options)
+{
+    struct kiwmi_process *process = malloc(sizeof(*process));
+    if (!process) {
+        return NULL;
+    }
+
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        free(process);
+        return NULL;
+    }
+
+    int err[2];
+    if (pipe2(err, O_CLOEXEC) < 0) {
+        int error = errno;
+        close(out[0]);
+        close(out[1]);
+        free(process);
+        errno = error;
+        return NULL;
+    }
+
+    struct kiwmi_spawn_options child_options = *options;
+    child_options.stdout_fd                  = out[1];
+    child_options.stderr_fd                  = err[1];
+
+    pid_t pid = process_spawn(&child_options);
+    int error = errno;
+
+    // the child holds the only write ends now, so EOF means it's done
+    close(out[1]);
+    close(err[1]);
+
+    if (pid < 0) {
+        close(out[0]);
+        close(err[0]);
+        free(process);
+        errno = error;
+        return NULL;
+    }
+
+    process->server = server;
+    process->pid    = pid;
+    process->exited = false;
+    process->status = 0;
+
+    wl_signal_init(&process->events.stdout_data);
+    wl_signal_init(&process->events.stderr_data);
+    wl_signal_init(&process->events.exit);
+    wl_signal_init(&process->events.destroy);
+
+    process_pipe_init(
+        &process->out, process, &process->events.stdout_data, out[0]);
+    process_pipe_init(
+        &process->err, process, &process->events.stderr_data, err[0]);
+
+    wl_list_insert(&server->processes, &process->link);
+
+    return process;
+}
+
+static int
+process_sigchld_notify(int UNUSED(signal_number), void *data)
+{
+    struct kiwmi_server *server = data;
+
+    // reap every child, including the ones from process_spawn()
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct kiwmi_process *process;
+        wl_list_for_each (process, &server->processes, link) {
+            if (process->pid == pid) {
+                process->exited = true;
+                process->status = status;
+                process_maybe_finish(process);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Must be called before any threads are started, as SIGCHLD gets blocked in
+ * favour of a signalfd on the event loop.
+ */
+bool
+process_reaper_init(struct kiwmi_server *server)
+{
+    wl_list_init(&server->processes);
+
+    server->sigchld_source = wl_event_loop_add_signal(
+        server->wl_event_loop, SIGCHLD, process_sigchld_notify, server);
+
+    return server->sigchld_source != NULL;
+}
+
+void
+process_reaper_fini(struct kiwmi_server *server)
+{
+    struct kiwmi_process *process;
+    struct kiwmi_process *tmp;
+    wl_list_for_each_safe (process, tmp, &server->processes, link) {
+        process_pipe_close(&process->out);
+        process_pipe_close(&process->err);
+        process_destroy(process);
+    }
+
+    wl_event_source_remove(server->sigchld_source);
+}
@@ -22,7 +22,9 @@
 #include <wlr/types/wlr_screencopy_v1.h>
 #include <wlr/util/log.h>
 
+#include "luak/ipc.h"
 #include "luak/luak.h"
+#include "process.h"
 
 bool
 server_init(struct kiwmi_server *server, char *config_path)
@@ -37,6 +39,18 @@ server_init(struct kiwmi_server *server, char *config_path)
 
     server->wl_event_loop = wl_display_get_event_loop(server->wl_display);
 
+    if (!process_reaper_init(server)) {
+        wlr_log(WLR_ERROR, "Failed to watch for SIGCHLD");
+        wl_display_destroy(server->wl_display);
+        return false;
+    }
+
+    if (!timer_queue_init(&server->timers, server->wl_event_loop)) {
+        wlr_log(WLR_ERROR, "Failed to initialize timers");
+        wl_display_destroy(server->wl_display);
+        return false;
+    }
+
     server->backend = wlr_backend_autocreate(server->wl_display);
     if (!server->backend) {
         wlr_log(WLR_ERROR, "Failed to create backend");
@@ -106,6 +120,13 @@ server_init(struct kiwmi_server *server, char *config_path)
         return false;
     }
 
+    if (!luaK_ipc_init(server)) {
+        wlr_log(WLR_ERROR, "Failed to initialize IPC");
+        wl_display_destroy(server->wl_display);
+        luaK_destroy(server->lua);
+        return false;
+    }
+
     return true;
 }
 
@@ -141,9 +162,12 @@ server_fini(struct kiwmi_server *server)
     wl_signal_emit(&server->events.destroy, server);
 
     wl_display_destroy_clients(server->wl_display);
+    luaK_ipc_fini(server);
 
     desktop_fini(&server->desktop);
     input_fini(&server->input);
+    process_reaper_fini(server);
+    timer_queue_fini(&server->timers);
 
     wl_display_destroy(server->wl_display);
 
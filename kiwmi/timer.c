@@ -0,0 +1,307 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "timer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <wayland-server.h>
+#include <wlr/util/log.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+uint64_t
+timer_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static void
+heap_swap(struct kiwmi_timer_queue *queue, size_t a, size_t b)
+{
+    struct kiwmi_timer *tmp = queue->heap[a];
+    queue->heap[a]          = queue->heap[b];
+    queue->heap[b]          = tmp;
+
+    queue->heap[a]->index = a;
+    queue->heap[b]->index = b;
+}
+
+static void
+heap_sift_up(struct kiwmi_timer_queue *queue, size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (queue->heap[parent]->deadline <= queue->heap[i]->deadline) {
+            break;
+        }
+
+        heap_swap(queue, i, parent);
+        i = parent;
+    }
+}
+
+static void
+heap_sift_down(struct kiwmi_timer_queue *queue, size_t i)
+{
+    while (true) {
+        size_t left  = 2 * i + 1;
+        size_t right = 2 * i + 2;
+        size_t min   = i;
+
+        if (left < queue->len
+            && queue->heap[left]->deadline < queue->heap[min]->deadline) {
+            min = left;
+        }
+        if (right < queue->len
+            && queue->heap[right]->deadline < queue->heap[min]->deadline) {
+            min = right;
+        }
+
+        if (min == i) {
+            break;
+        }
+
+        heap_swap(queue, i, min);
+        i = min;
+    }
+}
+
+static bool
+heap_insert(struct kiwmi_timer_queue *queue, struct kiwmi_timer *timer)
+{
+    if (queue->len == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+
+        struct kiwmi_timer **heap =
+            realloc(queue->heap, capacity * sizeof(*heap));
+        if (!heap) {
+            return false;
+        }
+
+        queue->heap     = heap;
+        queue->capacity = capacity;
+    }
+
+    timer->index              = queue->len;
+    queue->heap[queue->len++] = timer;
+
+    heap_sift_up(queue, timer->index);
+
+    return true;
+}
+
+static void
+heap_remove(struct kiwmi_timer_queue *queue, struct kiwmi_timer *timer)
+{
+    size_t i    = timer->index;
+    size_t last = --queue->len;
+
+    if (i != last) {
+        heap_swap(queue, i, last);
+        heap_sift_down(queue, i);
+        heap_sift_up(queue, i);
+    }
+
+    timer->index = SIZE_MAX;
+}
+
+/**
+ * Saturates instead of wrapping around, so very long delays never fire.
+ */
+static uint64_t
+deadline_add(uint64_t deadline, uint64_t delay)
+{
+    return delay > UINT64_MAX - deadline ? UINT64_MAX : deadline + delay;
+}
+
+/**
+ * Only re-arms the timerfd when the earliest deadline is earlier than the
+ * armed expiry. Removing the earliest timer leaves the old expiry in place,
+ * which costs one spurious wakeup instead of a syscall per cancellation.
+ */
+static void
+timer_queue_update(struct kiwmi_timer_queue *queue)
+{
+    if (queue->len == 0) {
+        return;
+    }
+
+    uint64_t deadline = queue->heap[0]->deadline;
+    if (queue->armed != 0 && queue->armed <= deadline) {
+        return;
+    }
+
+    struct itimerspec spec = {
+        .it_value =
+            {
+                .tv_sec  = deadline / NSEC_PER_SEC,
+                .tv_nsec = deadline % NSEC_PER_SEC,
+            },
+    };
+
+    if (timerfd_settime(queue->fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        wlr_log_errno(WLR_ERROR, "Failed to arm timerfd");
+        return;
+    }
+
+    queue->armed = deadline;
+}
+
+static int
+timer_queue_handler(int fd, uint32_t UNUSED(mask), void *data)
+{
+    struct kiwmi_timer_queue *queue = data;
+
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        wlr_log_errno(WLR_ERROR, "Failed to read timerfd");
+    }
+
+    queue->armed = 0;
+
+    uint64_t now = timer_now();
+
+    // timers armed by the callbacks run on the next dispatch at the earliest
+    size_t budget = queue->len;
+
+    while (budget-- > 0 && queue->len > 0
+           && queue->heap[0]->deadline <= now) {
+        struct kiwmi_timer *timer = queue->heap[0];
+
+        heap_remove(queue, timer);
+
+        if (timer->interval) {
+            // skip missed periods instead of firing them in a burst
+            uint64_t missed = (now - timer->deadline) / timer->interval;
+            timer->deadline = deadline_add(
+                timer->deadline + missed * timer->interval, timer->interval);
+
+            // can't fail, the slot was just freed
+            heap_insert(queue, timer);
+        }
+
+        // may disarm or free the timer
+        timer->func(timer, timer->data);
+    }
+
+    timer_queue_update(queue);
+
+    return 0;
+}
+
+bool
+timer_queue_init(struct kiwmi_timer_queue *queue, struct wl_event_loop *loop)
+{
+    queue->heap     = NULL;
+    queue->len      = 0;
+    queue->capacity = 0;
+    queue->armed    = 0;
+
+    queue->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (queue->fd < 0) {
+        wlr_log_errno(WLR_ERROR, "Failed to create timerfd");
+        return false;
+    }
+
+    queue->event_source = wl_event_loop_add_fd(
+        loop, queue->fd, WL_EVENT_READABLE, timer_queue_handler, queue);
+    if (!queue->event_source) {
+        wlr_log(WLR_ERROR, "Failed to watch timerfd");
+        close(queue->fd);
+        queue->fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Pending timers are dropped, but stay valid to disarm.
+ */
+void
+timer_queue_fini(struct kiwmi_timer_queue *queue)
+{
+    for (size_t i = 0; i < queue->len; ++i) {
+        queue->heap[i]->index = SIZE_MAX;
+    }
+
+    free(queue->heap);
+    queue->heap     = NULL;
+    queue->len      = 0;
+    queue->capacity = 0;
+
+    if (queue->fd >= 0) {
+        wl_event_source_remove(queue->event_source);
+        close(queue->fd);
+        queue->fd = -1;
+    }
+}
+
+void
+timer_init(
+    struct kiwmi_timer *timer,
+    struct kiwmi_timer_queue *queue,
+    kiwmi_timer_func_t func,
+    void *data)
+{
+    timer->queue    = queue;
+    timer->func     = func;
+    timer->data     = data;
+    timer->deadline = 0;
+    timer->interval = 0;
+    timer->index    = SIZE_MAX;
+}
+
+/**
+ * (Re)arms the timer to fire after 'delay' and then every 'interval'
+ * nanoseconds, unless 'interval' is 0.
+ */
+bool
+timer_arm(struct kiwmi_timer *timer, uint64_t delay, uint64_t interval)
+{
+    struct kiwmi_timer_queue *queue = timer->queue;
+
+    if (queue->fd < 0) {
+        return false;
+    }
+
+    timer_disarm(timer);
+
+    timer->deadline = deadline_add(timer_now(), delay);
+    timer->interval = interval;
+
+    if (!heap_insert(queue, timer)) {
+        return false;
+    }
+
+    timer_queue_update(queue);
+
+    return true;
+}
+
+void
+timer_disarm(struct kiwmi_timer *timer)
+{
+    if (timer_pending(timer)) {
+        heap_remove(timer->queue, timer);
+    }
+}
+
+bool
+timer_pending(struct kiwmi_timer *timer)
+{
+    return timer->index != SIZE_MAX;
+}
@@ -0,0 +1,501 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// for memfd_create
+#define _GNU_SOURCE
+
+#include "kiwmic/client.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "kiwmi-ipc-client-protocol.h"
+
+static void
+command_done(
+    void *data,
+    struct kiwmi_command *kiwmi_command,
+    uint32_t error,
+    const char *message)
+{
+    struct kiwmic_command *command = data;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    command->done    = true;
+    command->done_at = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    command->success = error == KIWMI_COMMAND_ERROR_SUCCESS;
+    if (command->result_fd < 0) {
+        command->message = strdup(message);
+    }
+
+    kiwmi_command_destroy(kiwmi_command);
+    command->command = NULL;
+
+    --command->client->in_flight;
+}
+
+static const struct kiwmi_command_listener command_listener = {
+    .done = command_done,
+};
+
+static void
+registry_global(
+    void *data,
+    struct wl_registry *registry,
+    uint32_t name,
+    const char *interface,
+    uint32_t version)
+{
+    struct kiwmic_client *client = data;
+    if (strcmp(interface, kiwmi_ipc_interface.name) == 0) {
+        if (version > KIWMIC_CLIENT_VERSION) {
+            version = KIWMIC_CLIENT_VERSION;
+        }
+        client->ipc =
+            wl_registry_bind(registry, name, &kiwmi_ipc_interface, version);
+    }
+}
+
+static void
+registry_global_remove(
+    void *UNUSED(data),
+    struct wl_registry *UNUSED(registry),
+    uint32_t UNUSED(name))
+{
+    // EMPTY
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global        = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+struct snapshot_memfd {
+    int fd;
+    uint32_t size;
+};
+
+static void
+snapshot_memfd(
+    void *data,
+    struct kiwmi_snapshot *UNUSED(kiwmi_snapshot),
+    int32_t fd,
+    uint32_t size)
+{
+    struct snapshot_memfd *memfd = data;
+
+    memfd->fd   = fd;
+    memfd->size = size;
+}
+
+static const struct kiwmi_snapshot_listener snapshot_listener = {
+    .memfd = snapshot_memfd,
+};
+
+/**
+ * Reads the results of a command sent with eval_fd, kiwmi writes them in the
+ * background.
+ */
+static void
+command_read_result(struct kiwmic_command *command)
+{
+    if (command->result_fd < 0) {
+        return;
+    }
+
+    char *data      = NULL;
+    size_t len      = 0;
+    size_t capacity = 0;
+
+    while (true) {
+        if (len + 1 >= capacity) {
+            capacity    = capacity ? capacity * 2 : 4096;
+            char *grown = realloc(data, capacity);
+            if (!grown) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+        }
+
+        ssize_t n = read(command->result_fd, data + len, capacity - len - 1);
+        if (n > 0) {
+            len += n;
+        } else if (n == 0 || errno != EINTR) {
+            data[len] = '\0';
+            break;
+        }
+    }
+
+    close(command->result_fd);
+    command->result_fd = -1;
+    command->message   = data;
+}
+
+/**
+ * Sends 'message' through a memfd and has the results written to a pipe, so
+ * neither is limited by the size of a Wayland message.
+ */
+static struct kiwmi_command *
+client_eval_fd(
+    struct kiwmic_client *client,
+    const char *message,
+    int format,
+    int *result_fd)
+{
+    int body = memfd_create("kiwmic", MFD_CLOEXEC);
+    if (body < 0) {
+        return NULL;
+    }
+
+    size_t len     = strlen(message);
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(body, message + written, len - written);
+        if (n < 0 && errno != EINTR) {
+            close(body);
+            return NULL;
+        }
+        written += n > 0 ? n : 0;
+    }
+    lseek(body, 0, SEEK_SET);
+
+    int result[2];
+    if (pipe2(result, O_CLOEXEC)) {
+        close(body);
+        return NULL;
+    }
+
+    struct kiwmi_command *command = kiwmi_ipc_eval_fd(
+        client->ipc,
+        body,
+        result[1],
+        format < 0 ? KIWMI_IPC_FORMAT_TEXT : (uint32_t)format);
+
+    // the request carries copies of both
+    close(body);
+    close(result[1]);
+
+    *result_fd = result[0];
+
+    return command;
+}
+
+/**
+ * Binds to kiwmi_ipc on 'display', which stays owned by the caller. Returns
+ * NULL if it isn't kiwmi.
+ */
+struct kiwmic_client *
+kiwmic_client_create(struct wl_display *display)
+{
+    struct kiwmic_client *client = malloc(sizeof(*client));
+    if (!client) {
+        return NULL;
+    }
+
+    client->display   = display;
+    client->ipc       = NULL;
+    client->in_flight = 0;
+    wl_list_init(&client->pending);
+
+    struct wl_registry *registry = wl_display_get_registry(display);
+    wl_registry_add_listener(registry, &registry_listener, client);
+    wl_display_roundtrip(display);
+    wl_registry_destroy(registry);
+
+    if (!client->ipc) {
+        free(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+/**
+ * Results that haven't been waited for are thrown away.
+ */
+void
+kiwmic_client_destroy(struct kiwmic_client *client)
+{
+    struct kiwmic_command *command;
+    struct kiwmic_command *tmp;
+    wl_list_for_each_safe (command, tmp, &client->pending, link) {
+        wl_list_remove(&command->link);
+        kiwmic_command_destroy(command);
+    }
+
+    kiwmi_ipc_destroy(client->ipc);
+    free(client);
+}
+
+uint32_t
+kiwmic_client_version(struct kiwmic_client *client)
+{
+    return kiwmi_ipc_get_version(client->ipc);
+}
+
+/**
+ * Queues 'message' for evaluation, encoding the results in 'format', or in
+ * the text format without a version check if it is negative. Only blocks
+ * while KIWMIC_MAX_IN_FLIGHT commands are waiting for their results, as
+ * kiwmi disconnects clients that fall too far behind reading them.
+ *
+ * Messages too long for a Wayland message are sent through a memfd, as are
+ * all of them if 'side_channel' is set, for results that might not fit in
+ * one either. It costs a few fds and syscalls per command, though.
+ */
+bool
+kiwmic_client_eval(
+    struct kiwmic_client *client,
+    const char *message,
+    int format,
+    bool side_channel)
+{
+    if (format >= 0
+        && kiwmic_client_version(client)
+               < KIWMI_IPC_EVAL_FORMAT_SINCE_VERSION) {
+        return false;
+    }
+
+    while (client->in_flight >= KIWMIC_MAX_IN_FLIGHT) {
+        if (wl_display_dispatch(client->display) == -1) {
+            return false;
+        }
+    }
+
+    struct kiwmic_command *command = calloc(1, sizeof(*command));
+    if (!command) {
+        return false;
+    }
+
+    command->client    = client;
+    command->result_fd = -1;
+
+    if ((side_channel || strlen(message) > KIWMIC_MAX_INLINE)
+        && kiwmic_client_version(client) >= KIWMI_IPC_EVAL_FD_SINCE_VERSION) {
+        command->command =
+            client_eval_fd(client, message, format, &command->result_fd);
+    }
+
+    if (!command->command && format < 0) {
+        // without a side channel, the message has to fit in a Wayland one
+        command->command = kiwmi_ipc_eval(client->ipc, message);
+    } else if (!command->command) {
+        command->command = kiwmi_ipc_eval_format(client->ipc, message, format);
+    }
+
+    if (!command->command) {
+        free(command);
+        return false;
+    }
+
+    kiwmi_command_add_listener(command->command, &command_listener, command);
+    wl_list_insert(client->pending.prev, &command->link);
+    ++client->in_flight;
+
+    return true;
+}
+
+/**
+ * Returns the oldest command if it is done already, without waiting. Only
+ * events dispatched before are taken into account, see
+ * kiwmic_client_dispatch().
+ */
+struct kiwmic_command *
+kiwmic_client_poll(struct kiwmic_client *client)
+{
+    if (wl_list_empty(&client->pending)) {
+        return NULL;
+    }
+
+    struct kiwmic_command *command =
+        wl_container_of(client->pending.next, command, link);
+    if (!command->done) {
+        return NULL;
+    }
+
+    wl_list_remove(&command->link);
+    command_read_result(command);
+
+    return command;
+}
+
+/**
+ * Sends what has been queued and dispatches the events kiwmi sent, waiting
+ * for some to come in unless 'fd' becomes readable first. Returns 1 if 'fd'
+ * is readable, -1 if the connection broke and 0 otherwise. 'fd' may be -1.
+ */
+int
+kiwmic_client_dispatch(struct kiwmic_client *client, int fd)
+{
+    struct wl_display *display = client->display;
+
+    if (wl_display_prepare_read(display) != 0) {
+        // events have been read along with earlier ones already
+        return wl_display_dispatch_pending(display) == -1 ? -1 : 0;
+    }
+
+    struct pollfd fds[] = {
+        {.fd = wl_display_get_fd(display), .events = POLLIN},
+        {.fd = fd, .events = POLLIN},
+    };
+
+    if (wl_display_flush(display) == -1) {
+        if (errno != EAGAIN) {
+            wl_display_cancel_read(display);
+            return -1;
+        }
+        fds[0].events |= POLLOUT;
+    }
+
+    if (poll(fds, fd >= 0 ? 2 : 1, -1) == -1) {
+        wl_display_cancel_read(display);
+        return errno == EINTR ? 0 : -1;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+        if (wl_display_read_events(display) == -1) {
+            return -1;
+        }
+    } else {
+        wl_display_cancel_read(display);
+    }
+
+    if (wl_display_dispatch_pending(display) == -1) {
+        return -1;
+    }
+
+    return fd >= 0 && fds[1].revents ? 1 : 0;
+}
+
+/**
+ * Returns the oldest command once it is done, or NULL if there is none or
+ * the connection broke. Sends whatever has been queued in the meantime.
+ */
+struct kiwmic_command *
+kiwmic_client_wait(struct kiwmic_client *client)
+{
+    if (wl_list_empty(&client->pending)) {
+        return NULL;
+    }
+
+    struct kiwmic_command *command =
+        wl_container_of(client->pending.next, command, link);
+
+    while (!command->done) {
+        if (wl_display_dispatch(client->display) == -1) {
+            return NULL;
+        }
+    }
+
+    wl_list_remove(&command->link);
+    command_read_result(command);
+
+    return command;
+}
+
+void
+kiwmic_command_destroy(struct kiwmic_command *command)
+{
+    if (command->command) {
+        kiwmi_command_destroy(command->command);
+    }
+    if (command->result_fd >= 0) {
+        close(command->result_fd);
+    }
+
+    free(command->message);
+    free(command);
+}
+
+/**
+ * Maps the state kiwmi keeps up to date in shared memory, or returns NULL if
+ * it doesn't provide it.
+ */
+const struct kiwmi_snapshot_data *
+kiwmic_client_map_snapshot(struct kiwmic_client *client)
+{
+    if (kiwmic_client_version(client) < KIWMI_IPC_GET_SNAPSHOT_SINCE_VERSION) {
+        return NULL;
+    }
+
+    struct snapshot_memfd memfd = {
+        .fd   = -1,
+        .size = 0,
+    };
+
+    struct kiwmi_snapshot *snapshot = kiwmi_ipc_get_snapshot(client->ipc);
+    kiwmi_snapshot_add_listener(snapshot, &snapshot_listener, &memfd);
+    wl_display_roundtrip(client->display);
+    kiwmi_snapshot_destroy(snapshot);
+
+    if (memfd.fd < 0) {
+        return NULL;
+    }
+
+    const struct kiwmi_snapshot_data *data = NULL;
+    if (memfd.size >= sizeof(*data)) {
+        data = mmap(NULL, sizeof(*data), PROT_READ, MAP_SHARED, memfd.fd, 0);
+    }
+    close(memfd.fd);
+
+    if (!data || data == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (data->magic != KIWMI_SNAPSHOT_MAGIC
+        || data->version != KIWMI_SNAPSHOT_VERSION) {
+        kiwmic_snapshot_unmap(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+void
+kiwmic_snapshot_unmap(const struct kiwmi_snapshot_data *snapshot)
+{
+    munmap((void *)snapshot, sizeof(*snapshot));
+}
+
+/**
+ * Copies out a consistent state, retrying while kiwmi is updating it. Gives
+ * up after a while, in case kiwmi died in the middle of an update.
+ */
+bool
+kiwmic_snapshot_read(
+    const struct kiwmi_snapshot_data *snapshot,
+    struct kiwmi_snapshot_data *copy)
+{
+    for (int i = 0; i < 10000; ++i) {
+        uint32_t seq =
+            atomic_load_explicit(&snapshot->seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+
+        memcpy(copy, snapshot, sizeof(*copy));
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&snapshot->seq, memory_order_relaxed) == seq) {
+            return true;
+        }
+    }
+
+    return false;
+}
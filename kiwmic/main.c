@@ -5,74 +5,658 @@
  * You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
 
 #include <wayland-client.h>
 
 #include "kiwmi-ipc-client-protocol.h"
+#include "kiwmic/client.h"
+
+static const struct {
+    const char *name;
+    uint32_t event_class;
+} event_classes[] = {
+    {"view", KIWMI_IPC_EVENT_CLASS_VIEW},
+    {"focus", KIWMI_IPC_EVENT_CLASS_FOCUS},
+    {"output", KIWMI_IPC_EVENT_CLASS_OUTPUT},
+    {"custom", KIWMI_IPC_EVENT_CLASS_CUSTOM},
+};
+
+static const size_t event_classes_len =
+    sizeof(event_classes) / sizeof(event_classes[0]);
+
+/**
+ * Parses a comma separated list of event class names, or "all".
+ */
+static bool
+parse_event_classes(const char *list, uint32_t *classes)
+{
+    *classes = 0;
+
+    while (*list) {
+        size_t len = strcspn(list, ",");
+
+        if (len == 3 && strncmp(list, "all", len) == 0) {
+            for (size_t i = 0; i < event_classes_len; ++i) {
+                *classes |= event_classes[i].event_class;
+            }
+        } else {
+            size_t i;
+            for (i = 0; i < event_classes_len; ++i) {
+                if (strlen(event_classes[i].name) == len
+                    && strncmp(list, event_classes[i].name, len) == 0) {
+                    *classes |= event_classes[i].event_class;
+                    break;
+                }
+            }
+
+            if (i == event_classes_len) {
+                fprintf(stderr, "Unknown event class '%.*s'\n", (int)len, list);
+                return false;
+            }
+        }
+
+        list += len;
+        if (*list) {
+            ++list;
+        }
+    }
+
+    return *classes != 0;
+}
+
+static void
+print_json_string(const char *str)
+{
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *)str; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
 
 static void
-command_done(
+subscription_event(
     void *data,
-    struct kiwmi_command *UNUSED(kiwmi_command),
-    uint32_t error,
-    const char *message)
+    struct kiwmi_subscription *UNUSED(kiwmi_subscription),
+    uint32_t event_class,
+    const char *name,
+    const char *payload)
 {
-    int *exit_code = data;
-    FILE *out;
+    int *format = data;
+
+    const char *class_name = "unknown";
+    for (size_t i = 0; i < event_classes_len; ++i) {
+        if (event_classes[i].event_class == event_class) {
+            class_name = event_classes[i].name;
+            break;
+        }
+    }
 
-    if (error == KIWMI_COMMAND_ERROR_SUCCESS) {
-        *exit_code = EXIT_SUCCESS;
-        out        = stdout;
+    if (*format == KIWMI_IPC_FORMAT_JSON) {
+        printf("{\"class\":\"%s\",\"event\":", class_name);
+        print_json_string(name);
+        printf(",\"data\":%s}\n", payload);
     } else {
+        printf("%s\t%s\t%s\n", class_name, name, payload);
+    }
+
+    // someone is most likely waiting on the other end of a pipe
+    fflush(stdout);
+}
+
+static const struct kiwmi_subscription_listener subscription_listener = {
+    .event = subscription_event,
+};
+
+static void
+print_box(const struct kiwmi_snapshot_box *box, bool json)
+{
+    const char *fmt = json ? "{\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d}"
+                           : "%d,%d %dx%d";
+    printf(fmt, box->x, box->y, box->width, box->height);
+}
+
+/**
+ * Prints one line per output and view, or a single JSON object.
+ */
+static void
+print_snapshot(const struct kiwmi_snapshot_data *snapshot, int format)
+{
+    bool json = format == KIWMI_IPC_FORMAT_JSON;
+
+    printf(
+        json ? "{\"focused_view\":%llu,\"outputs\":[" : "focused\t%llu\n",
+        (unsigned long long)snapshot->focused_view);
+
+    for (uint32_t i = 0; i < snapshot->output_count; ++i) {
+        const struct kiwmi_snapshot_output *output = &snapshot->outputs[i];
+
+        if (json) {
+            printf(i > 0 ? ",{\"name\":" : "{\"name\":");
+            print_json_string(output->name);
+            printf(",\"geometry\":");
+            print_box(&output->geometry, true);
+            printf(",\"usable_area\":");
+            print_box(&output->usable_area, true);
+            printf("}");
+        } else {
+            printf("output\t%s\t", output->name);
+            print_box(&output->geometry, false);
+            printf("\t");
+            print_box(&output->usable_area, false);
+            printf("\n");
+        }
+    }
+
+    if (json) {
+        printf("],\"views\":[");
+    }
+
+    for (uint32_t i = 0; i < snapshot->view_count; ++i) {
+        const struct kiwmi_snapshot_view *view = &snapshot->views[i];
+
+        if (json) {
+            printf(
+                i > 0 ? ",{\"id\":%llu,\"pid\":%d,\"app_id\":"
+                      : "{\"id\":%llu,\"pid\":%d,\"app_id\":",
+                (unsigned long long)view->id,
+                (int)view->pid);
+            print_json_string(view->app_id);
+            printf(",\"title\":");
+            print_json_string(view->title);
+            printf(",\"geometry\":");
+            print_box(&view->geometry, true);
+            printf("}");
+        } else {
+            printf(
+                "view\t%llu\t%d\t%s\t%s\t",
+                (unsigned long long)view->id,
+                (int)view->pid,
+                view->app_id,
+                view->title);
+            print_box(&view->geometry, false);
+            printf("\n");
+        }
+    }
+
+    if (json) {
+        printf("]}\n");
+    }
+}
+
+/**
+ * Prints the result followed by 'delimiter', to stderr if it is an error.
+ * In batch mode, empty results are printed too, to keep them apart.
+ */
+static void
+print_result(
+    struct kiwmic_command *command,
+    int delimiter,
+    bool batch,
+    int *exit_code)
+{
+    FILE *out = stdout;
+    if (!command->success) {
         *exit_code = EXIT_FAILURE;
         out        = stderr;
     }
 
-    if (message[0] != '\0') {
-        fprintf(out, "%s\n", message);
+    const char *message = command->message ? command->message : "";
+    if (batch || message[0] != '\0') {
+        fprintf(out, "%s%c", message, delimiter);
+        // the other end might be waiting for it before sending the next one
+        fflush(out);
     }
+
+    kiwmic_command_destroy(command);
 }
 
-static const struct kiwmi_command_listener command_listener = {
-    .done = command_done,
-};
+/**
+ * Sends the complete commands in 'buffer', and moves what is left of the
+ * last one to its start. Returns false if kiwmi couldn't be reached.
+ */
+static bool
+send_commands(
+    struct kiwmic_client *client,
+    char *buffer,
+    size_t *len,
+    int format,
+    int delimiter)
+{
+    char *line = buffer;
+    char *end;
+    while ((end = memchr(line, delimiter, *len - (line - buffer)))) {
+        *end = '\0';
+        if (end > line && !kiwmic_client_eval(client, line, format, false)) {
+            return false;
+        }
+        line = end + 1;
+    }
 
-static void
-registry_global(
-    void *data,
-    struct wl_registry *registry,
-    uint32_t name,
-    const char *interface,
-    uint32_t UNUSED(version))
+    *len -= line - buffer;
+    memmove(buffer, line, *len);
+
+    return true;
+}
+
+/**
+ * Runs the commands read from stdin, pipelined on a single connection.
+ * Results are printed as soon as they come in, stdin is read without stdio
+ * so that nothing sits in its buffer unseen by poll().
+ */
+static int
+run_batch(struct kiwmic_client *client, int format, int delimiter)
 {
-    struct kiwmi_ipc **ipc = data;
-    if (strcmp(interface, kiwmi_ipc_interface.name) == 0) {
-        *ipc = wl_registry_bind(registry, name, &kiwmi_ipc_interface, 1);
+    int exit_code = EXIT_SUCCESS;
+    bool eof      = false;
+    bool broken   = false;
+
+    char *buffer    = NULL;
+    size_t len      = 0;
+    size_t capacity = 0;
+
+    while (!broken && (!eof || !wl_list_empty(&client->pending))) {
+        struct kiwmic_command *command;
+        while ((command = kiwmic_client_poll(client))) {
+            print_result(command, delimiter, true, &exit_code);
+        }
+
+        if (eof && wl_list_empty(&client->pending)) {
+            break;
+        }
+
+        int readable = kiwmic_client_dispatch(client, eof ? -1 : STDIN_FILENO);
+        if (readable == -1) {
+            broken = true;
+            break;
+        }
+        if (!readable) {
+            continue;
+        }
+
+        if (len + 1 >= capacity) {
+            capacity    = capacity ? capacity * 2 : 4096;
+            char *grown = realloc(buffer, capacity);
+            if (!grown) {
+                fprintf(stderr, "Failed to allocate a command\n");
+                exit_code = EXIT_FAILURE;
+                break;
+            }
+            buffer = grown;
+        }
+
+        ssize_t n = read(STDIN_FILENO, buffer + len, capacity - len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            // the last command doesn't need a delimiter
+            eof           = true;
+            buffer[len++] = delimiter;
+        } else {
+            len += n;
+        }
+
+        if (!send_commands(client, buffer, &len, format, delimiter)) {
+            broken = true;
+        }
+    }
+
+    free(buffer);
+
+    if (broken) {
+        fprintf(stderr, "Lost connection to kiwmi\n");
+        exit_code = EXIT_FAILURE;
     }
+
+    return exit_code;
+}
+
+static bool
+parse_count(const char *str, size_t *count)
+{
+    char *end;
+    unsigned long value = strtoul(str, &end, 10);
+    if (*str == '\0' || *str == '-' || *end != '\0' || value == 0) {
+        fprintf(stderr, "Invalid count '%s'\n", str);
+        return false;
+    }
+
+    *count = value;
+
+    return true;
 }
 
+static uint64_t
+now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+#define LOAD_LEASE_REFRESH 1000000000ull // ns
+
+/**
+ * Keeps the active output redrawing while the benchmark runs, which is
+ * enough to keep the headless backend busy. The load stops by itself a few
+ * seconds after it was last enabled, in case kiwmic doesn't get to disable
+ * it, so it has to be enabled again every LOAD_LEASE_REFRESH.
+ */
+static const char *load_enable =
+    "KIWMIC_LOAD_UNTIL = os.time() + 3\n"
+    "if not KIWMIC_LOAD then\n"
+    "    KIWMIC_LOAD = kiwmi:schedule(0, function()\n"
+    "        if os.time() > KIWMIC_LOAD_UNTIL then\n"
+    "            KIWMIC_LOAD:cancel()\n"
+    "            KIWMIC_LOAD = nil\n"
+    "            return\n"
+    "        end\n"
+    "        local output = kiwmi:active_output()\n"
+    "        if output then output:redraw() end\n"
+    "    end, 1)\n"
+    "end";
+
+static bool
+set_load(struct kiwmic_client *client, bool enabled)
+{
+    const char *message = enabled
+                            ? load_enable
+                            : "if KIWMIC_LOAD then KIWMIC_LOAD:cancel() end\n"
+                              "KIWMIC_LOAD = nil";
+
+    struct kiwmic_command *command = NULL;
+    if (kiwmic_client_eval(client, message, -1, false)) {
+        command = kiwmic_client_wait(client);
+    }
+
+    bool success = command && command->success;
+    if (command && !success) {
+        fprintf(stderr, "Failed to set up load: %s\n", command->message);
+    }
+    if (command) {
+        kiwmic_command_destroy(command);
+    }
+
+    return success;
+}
+
+/**
+ * Enables the load again through its own client, whose results are thrown
+ * away, so they don't mix with the ones being measured.
+ */
 static void
-registry_global_remove(
-    void *UNUSED(data),
-    struct wl_registry *UNUSED(registry),
-    uint32_t UNUSED(name))
+refresh_load(struct kiwmic_client *load, uint64_t now, uint64_t *refreshed)
 {
-    // EMPTY
+    struct kiwmic_command *command;
+    while ((command = kiwmic_client_poll(load))) {
+        kiwmic_command_destroy(command);
+    }
+
+    if (now - *refreshed < LOAD_LEASE_REFRESH) {
+        return;
+    }
+
+    if (kiwmic_client_eval(load, load_enable, -1, false)) {
+        *refreshed = now;
+    }
 }
 
-static const struct wl_registry_listener registry_listener = {
-    .global        = registry_global,
-    .global_remove = registry_global_remove,
-};
+/**
+ * Runs 'message' 'count' times, with up to 'concurrency' commands in flight,
+ * and prints the round-trip latencies and the throughput. The load is kept
+ * up through 'load', unless it is NULL.
+ */
+static int
+run_bench(
+    struct kiwmic_client *client,
+    struct kiwmic_client *load,
+    const char *message,
+    size_t count,
+    size_t concurrency,
+    int format)
+{
+    uint64_t *sent      = malloc(count * sizeof(*sent));
+    uint64_t *latencies = malloc(count * sizeof(*latencies));
+    if (!sent || !latencies) {
+        fprintf(stderr, "Failed to allocate %zu samples\n", count);
+        free(sent);
+        free(latencies);
+        return EXIT_FAILURE;
+    }
+
+    size_t issued    = 0;
+    size_t completed = 0;
+    size_t failed    = 0;
+
+    uint64_t start     = now_ns();
+    uint64_t refreshed = start;
+
+    while (completed < count) {
+        if (load) {
+            refresh_load(load, now_ns(), &refreshed);
+        }
+
+        while (issued < count && issued - completed < concurrency) {
+            // may block until earlier commands are done, which isn't latency
+            if (!kiwmic_client_eval(client, message, -1, false)) {
+                break;
+            }
+            sent[issued++] = now_ns();
+        }
+
+        // results that came in along with the awaited one are done as well
+        struct kiwmic_command *command = kiwmic_client_wait(client);
+        if (!command) {
+            break;
+        }
+
+        do {
+            if (!command->success) {
+                ++failed;
+            }
+            latencies[completed] = command->done_at - sent[completed];
+            ++completed;
+
+            kiwmic_command_destroy(command);
+        } while ((command = kiwmic_client_poll(client)));
+    }
+
+    uint64_t elapsed = now_ns() - start;
+
+    free(sent);
+
+    if (completed < count) {
+        fprintf(stderr, "Lost connection to kiwmi\n");
+        free(latencies);
+        return EXIT_FAILURE;
+    }
+
+    qsort(latencies, count, sizeof(*latencies), compare_u64);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total += latencies[i];
+    }
+
+    // nearest rank
+    size_t p99 = (count * 99 + 99) / 100 - 1;
+
+    double min_ms     = latencies[0] / 1e6;
+    double mean_ms    = (double)total / count / 1e6;
+    double p99_ms     = latencies[p99] / 1e6;
+    double throughput = count / (elapsed / 1e9);
+
+    free(latencies);
+
+    if (format == KIWMI_IPC_FORMAT_JSON) {
+        printf(
+            "{\"count\":%zu,\"concurrency\":%zu,\"failed\":%zu,"
+            "\"min_ms\":%.3f,\"mean_ms\":%.3f,\"p99_ms\":%.3f,"
+            "\"throughput\":%.1f}\n",
+            count,
+            concurrency,
+            failed,
+            min_ms,
+            mean_ms,
+            p99_ms,
+            throughput);
+    } else {
+        printf(
+            "commands    %zu (%zu failed), %zu in flight\n"
+            "latency     min %.3f ms, mean %.3f ms, p99 %.3f ms\n"
+            "throughput  %.1f commands/s\n",
+            count,
+            failed,
+            concurrency,
+            min_ms,
+            mean_ms,
+            p99_ms,
+            throughput);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
 int
 main(int argc, char **argv)
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: kiwmic COMMAND\n");
+    const char *usage =
+        "Usage: kiwmic [options] COMMAND\n"
+        "       kiwmic [options] -b|-\n"
+        "       kiwmic [options] -s CLASSES\n"
+        "       kiwmic [options] -S\n"
+        "       kiwmic [options] -B N [COMMAND]\n"
+        "\n"
+        "  -h, --help               Show help message and exit\n"
+        "  -b, --batch              Run commands read from stdin, one per\n"
+        "                           line\n"
+        "  -z, --null               Commands and results are separated by\n"
+        "                           NUL instead of newline characters\n"
+        "  -f, --format FORMAT      Output format, text (default) or json\n"
+        "  -S, --state              Print the outputs and views kiwmi shares\n"
+        "                           in memory, without running any Lua\n"
+        "  -s, --subscribe CLASSES  Print events of the given classes as they\n"
+        "                           happen, a comma separated list of view,\n"
+        "                           focus, output and custom, or all\n"
+        "  -B, --bench N            Run COMMAND (default: 'return') N times\n"
+        "                           and print the round-trip latencies\n"
+        "  -c, --concurrency C      Keep up to C commands in flight while\n"
+        "                           benchmarking, 1 (default) runs them\n"
+        "                           one after another\n"
+        "  -l, --load               Keep the active output redrawing while\n"
+        "                           benchmarking\n";
+
+    static const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"batch", no_argument, NULL, 'b'},
+        {"null", no_argument, NULL, 'z'},
+        {"format", required_argument, NULL, 'f'},
+        {"subscribe", required_argument, NULL, 's'},
+        {"state", no_argument, NULL, 'S'},
+        {"bench", required_argument, NULL, 'B'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"load", no_argument, NULL, 'l'},
+        {0},
+    };
+
+    int format         = -1;
+    uint32_t subscribe = 0;
+    bool batch         = false;
+    bool state         = false;
+    int delimiter      = '\n';
+    size_t bench       = 0;
+    size_t concurrency = 1;
+    bool load          = false;
+
+    int option;
+    while ((option = getopt_long(
+                argc, argv, "hbzf:s:SB:c:l", long_options, NULL))
+           != -1) {
+        switch (option) {
+        case 'h':
+            printf("%s", usage);
+            exit(EXIT_SUCCESS);
+            break;
+        case 'b':
+            batch = true;
+            break;
+        case 'z':
+            delimiter = '\0';
+            break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0) {
+                format = KIWMI_IPC_FORMAT_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                format = KIWMI_IPC_FORMAT_JSON;
+            } else {
+                fprintf(stderr, "Unknown format '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            if (!parse_event_classes(optarg, &subscribe)) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            state = true;
+            break;
+        case 'B':
+            if (!parse_count(optarg, &bench)) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            if (!parse_count(optarg, &concurrency)) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            load = true;
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind == argc - 1 && strcmp(argv[optind], "-") == 0) {
+        batch = true;
+        ++optind;
+    }
+
+    const char *bench_command = "return";
+    if (bench && optind == argc - 1) {
+        bench_command = argv[optind++];
+    }
+
+    if (optind != argc - (subscribe || batch || state || bench ? 0 : 1)) {
+        fprintf(stderr, "%s", usage);
         exit(EXIT_FAILURE);
     }
 
@@ -82,21 +666,95 @@ main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    struct wl_registry *registry = wl_display_get_registry(display);
-    struct kiwmi_ipc *ipc        = NULL;
+    struct kiwmic_client *client = kiwmic_client_create(display);
+    if (!client) {
+        fprintf(stderr, "Failed to bind to kiwmi_ipc\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t version = kiwmic_client_version(client);
 
-    wl_registry_add_listener(registry, &registry_listener, &ipc);
-    wl_display_roundtrip(display);
+    if (state) {
+        const struct kiwmi_snapshot_data *snapshot =
+            kiwmic_client_map_snapshot(client);
+        if (!snapshot) {
+            fprintf(stderr, "kiwmi doesn't share its state\n");
+            exit(EXIT_FAILURE);
+        }
 
-    if (!ipc) {
-        fprintf(stderr, "Failed to bind to kiwmi_ipc\n");
+        struct kiwmi_snapshot_data copy;
+        if (!kiwmic_snapshot_read(snapshot, &copy)) {
+            fprintf(stderr, "Failed to read the state\n");
+            exit(EXIT_FAILURE);
+        }
+
+        print_snapshot(&copy, format);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (subscribe) {
+        if (version < KIWMI_IPC_SUBSCRIBE_SINCE_VERSION) {
+            fprintf(stderr, "kiwmi is too old to support --subscribe\n");
+            exit(EXIT_FAILURE);
+        }
+
+        struct kiwmi_subscription *subscription =
+            kiwmi_ipc_subscribe(client->ipc, subscribe);
+        kiwmi_subscription_add_listener(
+            subscription, &subscription_listener, &format);
+
+        while (wl_display_dispatch(display) != -1) {
+            // EMPTY
+        }
+
+        fprintf(stderr, "Lost connection to kiwmi\n");
         exit(EXIT_FAILURE);
     }
 
-    struct kiwmi_command *command = kiwmi_ipc_eval(ipc, argv[1]);
-    int exit_code;
-    kiwmi_command_add_listener(command, &command_listener, &exit_code);
-    wl_display_roundtrip(display);
+    if (format >= 0 && version < KIWMI_IPC_EVAL_FORMAT_SINCE_VERSION) {
+        fprintf(stderr, "kiwmi is too old to support -f\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int exit_code = EXIT_SUCCESS;
+
+    if (bench) {
+        struct kiwmic_client *load_client = NULL;
+        if (load) {
+            load_client = kiwmic_client_create(display);
+            if (!load_client) {
+                fprintf(stderr, "Failed to connect for the load\n");
+                exit(EXIT_FAILURE);
+            }
+            if (!set_load(load_client, true)) {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        exit_code = run_bench(
+            client, load_client, bench_command, bench, concurrency, format);
+
+        if (load_client) {
+            set_load(load_client, false);
+            kiwmic_client_destroy(load_client);
+        }
+    } else if (batch) {
+        exit_code = run_batch(client, format, delimiter);
+    } else {
+        struct kiwmic_command *command = NULL;
+        if (kiwmic_client_eval(client, argv[optind], format, true)) {
+            command = kiwmic_client_wait(client);
+        }
+
+        if (command) {
+            print_result(command, '\n', false, &exit_code);
+        } else {
+            fprintf(stderr, "Lost connection to kiwmi\n");
+            exit_code = EXIT_FAILURE;
+        }
+    }
+
+    kiwmic_client_destroy(client);
     wl_display_disconnect(display);
 
     exit(exit_code);